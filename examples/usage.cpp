@@ -25,48 +25,42 @@ SYSTEM_MODE(SEMI_AUTOMATIC);
 PRODUCT_ID(PLATFORM_ID);
 PRODUCT_VERSION(APP_VERSION);
 
-void priority_high_cb(publishStatus status,
+void priority_low_cb(particle::Error status,
     const char *event_name,
-    const char *event_data,
-    const void *event_context);
-
-void priority_low_cb(publishStatus status,
-    const char *event_name,
-    const char *event_data,
-    const void *event_context);
+    const char *event_data);
 
 SerialLogHandler logHandler(115200, LOG_LEVEL_ALL, {
 });
 
+BackgroundPublish<> publisher;
+
 void setup() {
-    BackgroundPublish::instance().init();
+    publisher.start();
     Particle.connect();
 }
 
 void loop() {
     static int counter = 0;
     static system_tick_t timer_start_ms = millis();
-    String* str;
 
     if(millis() - timer_start_ms > TIMEOUT_SEC) {
-        auto format = String::format("Counter:%d", counter);
-        str = new (std::nothrow) String(format);
         if(Particle.connected()) {
+            // The data is formatted directly into the queued event, no
+            // temporary String or heap allocation needed
             if(!(counter % 2)) {
-                if(!BackgroundPublish::instance().publish("TEST_PUB_HIGH", 
-                                    str->c_str(), 
-                                    PRIVATE,
-                                    0, 
-                                    priority_high_cb )) {
+                if(publisher.publishf("TEST_PUB_HIGH", 0, "Counter:%d", counter) < 0) {
                     Log.info("Failed publish request");
                 }
             }
             else {
-                if(!BackgroundPublish::instance().publish("TEST_PUB_LOW", 
-                                    str->c_str(), 
+                if(publisher.publishJson("TEST_PUB_LOW", [](JSONWriter& writer) {
+                                        writer.beginObject();
+                                        writer.name("counter").value(counter);
+                                        writer.endObject();
+                                    },
                                     PRIVATE,
-                                    1, 
-                                    priority_low_cb )) {
+                                    1,
+                                    priority_low_cb) < 0) {
                     Log.info("Failed publish request");
                 }
             }
@@ -78,26 +72,15 @@ void loop() {
         timer_start_ms = millis();
         //cleanup any unsent data after 100
         if(counter > 100) {
-            BackgroundPublish::instance().cleanup();
+            publisher.cleanup();
             counter = 0;
         }
     }
 }
 
-void priority_high_cb(publishStatus status,
+void priority_low_cb(particle::Error status,
     const char *event_name,
-    const char *event_data,
-    const void *event_context) {
-    
-    delete event_data;
-    Log.info("High callback fired, cleaned up memory");
-}
-
-void priority_low_cb(publishStatus status,
-    const char *event_name,
-    const char *event_data,
-    const void *event_context) {
+    const char *event_data) {
 
-    delete event_data;
-    Log.info("Low callback fired, cleaned up memory");
-}
\ No newline at end of file
+    Log.info("Low callback fired: %s", status.message());
+}
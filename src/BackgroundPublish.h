@@ -16,17 +16,45 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
 #include <cstddef>
+#include <cstdio>
 #include <cstdint>
 #include <cstring>
 #include <functional>
-#include <queue>
+#include <memory>
 
 #include "Particle.h"
+#include "PublishRing.h"
 
-template<std::size_t NumQueues = 2u>
+/**
+ * @brief Lifecycle hooks of BackgroundPublish, all empty
+ *
+ * @details To probe the stages of an event's life, e.g. toggle a GPIO or
+ * count bytes, derive from this struct, hide the hooks of interest and pass
+ * it as the Hooks template argument. The hooks are static, so the empty ones
+ * compile away. Each runs on the thread at that stage and must not block or
+ * publish
+ */
+struct no_publish_hooks {
+    // A publish function is about to queue the event
+    static void onEnqueue(const char* /*name*/, std::size_t /*priority*/) {}
+    // The publisher took the event from its queue
+    static void onDequeue(const char* /*name*/, std::size_t /*priority*/) {}
+    // The event is about to be passed to Particle.publish()
+    static void onSend(const char* /*name*/, const char* /*data*/, std::size_t /*priority*/) {}
+    // The event was sent, failed, evicted or cancelled
+    static void onComplete(const char* /*name*/, std::size_t /*priority*/, particle::Error /*error*/) {}
+};
+
+template<std::size_t NumQueues = 2u, typename Hooks = no_publish_hooks>
 class BackgroundPublish {
+    static_assert(NumQueues > 0 && NumQueues <= 32, "queue occupancy is tracked in a 32 bit mask");
+
 public:
     using publish_callback = std::function<void(particle::Error status,
         const char *event_name,
@@ -44,6 +72,317 @@ public:
     template<typename T, typename Context>
     using publish_callback_ptmf_with_context = void (T::*)(particle::Error, const char *event_name, const char *event_data, Context);
 
+    /**
+     * @brief Renders the event data of a deferred publish right before it is sent
+     *
+     * @details Writes a null terminated string of at most size - 1 characters
+     * into data and returns its length, like snprintf. Returning a negative
+     * value cancels the event instead of sending it.
+     */
+    using payload_producer = std::function<int(char *data, std::size_t size)>;
+
+    /**
+     * @brief Returns the current time in milliseconds, see setClock()
+     */
+    using clock_source = system_tick_t (*)();
+
+    /**
+     * @brief Callback for publishFromISR(), a plain function so nothing is
+     * copied or allocated in the interrupt
+     */
+    using isr_callback = void (*)(particle::Error status,
+        const char *event_name,
+        const char *event_data);
+
+    enum class publish_status : std::uint8_t {
+        UNKNOWN,    // not accepted, or the request is too old to track
+        QUEUED,
+        SENDING,
+        SENT,
+        FAILED,
+        CANCELLED,
+    };
+
+    /**
+     * @brief Handle to a publish request
+     *
+     * @details Returned by publish(), converts to TRUE if the request was
+     * accepted. It stays valid until the event slot it refers to is reused
+     * by a later request, after which status() reports UNKNOWN.
+     */
+    class publish_handle {
+    public:
+        publish_handle() : _owner {nullptr}, _index {0}, _generation {0} {}
+
+        operator bool() const { return _owner != nullptr; }
+
+        /**
+         * @brief Remove a queued event before it is sent, see BackgroundPublish::cancel()
+         */
+        bool cancel() const { return _owner && _owner->cancel(*this); }
+
+        /**
+         * @brief Current state of the request, see BackgroundPublish::status()
+         */
+        publish_status status() const { return _owner ? _owner->status(*this) : publish_status::UNKNOWN; }
+
+        /**
+         * @brief Move a queued event to another queue, see BackgroundPublish::reprioritize()
+         */
+        bool reprioritize(std::size_t priority) const { return _owner && _owner->reprioritize(*this, priority); }
+
+    private:
+        friend class BackgroundPublish;
+
+        publish_handle(BackgroundPublish *owner, std::uint16_t index, std::uint16_t generation) :
+            _owner {owner}, _index {index}, _generation {generation} {}
+
+        BackgroundPublish *_owner;
+        std::uint16_t _index;
+        std::uint16_t _generation;
+    };
+
+    /**
+     * @brief Completion of a publish request, returned by publishAsync()
+     *
+     * @details The result is kept in the event slot, so no allocation is
+     * needed. The slot is held until the future is destroyed or reset(), so
+     * keep only as many futures alive as the queues can spare. Move only, and
+     * must not outlive the publisher. Don't wait on a future from the
+     * publisher callbacks.
+     */
+    class publish_future {
+    public:
+        publish_future() : publish_future(particle::Error::INVALID_STATE) {}
+
+        publish_future(publish_future&& other) :
+            _owner {other._owner},
+            _index {other._index},
+            _error {other._error}
+        {
+            other._owner = nullptr;
+        }
+
+        publish_future& operator=(publish_future&& other)
+        {
+            if (this != &other) {
+                reset();
+                _owner = other._owner;
+                _index = other._index;
+                _error = other._error;
+                other._owner = nullptr;
+            }
+            return *this;
+        }
+
+        publish_future(const publish_future&) = delete;
+        publish_future& operator=(const publish_future&) = delete;
+
+        ~publish_future() { reset(); }
+
+        /**
+         * @brief TRUE if the request was accepted
+         */
+        bool isValid() const { return _owner != nullptr; }
+
+        /**
+         * @brief TRUE once the event was sent, failed or was cancelled.
+         * Rejected requests are done straight away
+         */
+        bool isDone() const { return _owner == nullptr || _owner->future_done(_index, nullptr); }
+
+        bool isSucceeded() const { return error() == particle::Error::NONE; }
+
+        /**
+         * @brief Outcome of the request, UNKNOWN while it isn't done
+         */
+        particle::Error error() const
+        {
+            particle::Error error {_error};
+            if (_owner != nullptr && !_owner->future_done(_index, &error)) {
+                return particle::Error::UNKNOWN;
+            }
+            return error;
+        }
+
+        /**
+         * @brief Block until the request is done or timeout expires. Can be
+         * called from any thread except the publisher's
+         *
+         * @return TRUE if the request is done
+         */
+        bool wait(std::chrono::milliseconds timeout) const
+        {
+            return _owner == nullptr || _owner->future_wait(_index, timeout);
+        }
+
+        /**
+         * @brief Call cb once the request is done, or straight away if it
+         * already is. Replaces any previous callback. The event data passed
+         * to cb is empty if the request was already done
+         */
+        publish_future& onDone(publish_callback cb)
+        {
+            if (_owner != nullptr) {
+                _owner->future_on_done(_index, cb);
+            } else {
+                notify(cb, _error, "", "");
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Release the event slot, the future becomes invalid
+         */
+        void reset()
+        {
+            if (_owner != nullptr) {
+                _owner->future_release(_index);
+                _owner = nullptr;
+                _error = particle::Error::INVALID_STATE;
+            }
+        }
+
+    private:
+        friend class BackgroundPublish;
+
+        explicit publish_future(particle::Error error) : _owner {nullptr}, _index {0}, _error {error} {}
+
+        publish_future(BackgroundPublish *owner, std::uint16_t index) :
+            _owner {owner}, _index {index}, _error {particle::Error::UNKNOWN} {}
+
+        BackgroundPublish *_owner;
+        std::uint16_t _index;
+        particle::Error _error; // reason a request was rejected
+    };
+
+    /**
+     * @brief One event of a bulk publish request
+     *
+     * @details result and handle are set by publishBulk() to the outcome of
+     * the request
+     */
+    struct publish_request_t {
+        const char *name;
+        const char *data;
+        PublishFlags flags;
+        std::size_t priority;
+        publish_callback cb;
+        particle::Error result;
+        publish_handle handle;
+    };
+
+    /**
+     * @brief What publish() does when a request doesn't fit
+     */
+    enum class overflow_policy {
+        DROP_NEWEST,            // reject the new request with BUSY
+        DROP_OLDEST,            // evict the oldest event in the same queue
+        DROP_LOWEST_PRIORITY,   // evict the oldest event of the lowest priority queue
+    };
+
+    /**
+     * @brief Where completion callbacks are called
+     */
+    enum class dispatch_mode {
+        INLINE,     // on the thread that completes the event
+        EXECUTOR,   // on a low priority thread created by start()
+        MANUAL,     // from dispatchCompletions(), e.g. in loop()
+    };
+
+    /**
+     * @brief What drives the sending of queued events
+     */
+    enum class run_mode {
+        THREADED,       // a publisher thread created by start()
+        COOPERATIVE,    // process() called from loop(), no thread is created
+    };
+
+    enum class bulk_mode {
+        BEST_EFFORT,    // queue every request that fits
+        ALL_OR_NOTHING, // queue all requests, or none if any doesn't fit
+    };
+
+    static constexpr std::size_t latency_buckets {16u};
+
+    /**
+     * @brief Log-scale histogram of latencies in milliseconds
+     *
+     * @details counts[0] holds latencies under 1 ms and counts[i] those from
+     * 2^(i-1) up to 2^i ms. The last bucket also holds everything longer
+     */
+    struct latency_histogram {
+        std::array<std::uint32_t, latency_buckets> counts;
+
+        /**
+         * @brief Estimate a percentile
+         *
+         * @param[in] percent percentile to estimate, e.g. 50 or 99
+         * @return Upper bound in milliseconds of the bucket holding the
+         * percentile, 0 if nothing was recorded
+         */
+        system_tick_t percentile(unsigned percent) const
+        {
+            std::uint64_t total {};
+            for (auto count : counts) {
+                total += count;
+            }
+            // Rank of the sample at the percentile, rounded up
+            auto rank {(total * std::min(percent, 100u) + 99u) / 100u};
+            std::uint64_t seen {};
+            for (std::size_t i = 0; i < latency_buckets && total != 0; i++) {
+                seen += counts[i];
+                if (seen >= rank && seen != 0) {
+                    return (system_tick_t)1u << i;
+                }
+            }
+            return 0;
+        }
+    };
+
+    /**
+     * @brief Counters of one priority queue, see stats()
+     *
+     * @details An event moved by reprioritize() is counted as enqueued at its
+     * old priority and completed at its new one
+     */
+    struct publish_stats {
+        std::size_t depth;          // events queued now
+        std::size_t highWater;      // most events queued at once
+        std::uint32_t enqueued;     // requests accepted
+        std::uint32_t sent;         // events the cloud acknowledged
+        std::uint32_t rejected;     // requests turned away for lack of room, BUSY or TIMEOUT
+        std::uint32_t cancelled;    // events cancelled or cleaned up before being sent
+        std::uint32_t evicted;      // events failed with BUSY by the overflow policy
+        std::uint32_t limited;      // events failed with LIMIT_EXCEEDED
+        std::uint32_t timedOut;     // events failed with TIMEOUT
+        std::uint32_t failed;       // events failed with any other error
+        latency_histogram queueWait; // from being queued to being sent
+        latency_histogram network;  // from being sent to the cloud answering
+    };
+
+    /**
+     * @brief Overhead of the publisher, see workerStats()
+     */
+    struct worker_stats {
+        std::uint32_t busyTime;     // milliseconds spent scheduling and sending
+        std::uint32_t idleTime;     // milliseconds the publisher thread slept
+        std::size_t stackSize;      // stack size passed to start(), 0 in COOPERATIVE mode
+        std::size_t stackUsed;      // deepest stack use seen in bytes, 0 until measured
+    };
+
+    /**
+     * @brief Lifecycle of a completed event, see trace()
+     */
+    struct trace_record {
+        std::uint32_t nameHash;     // FNV-1a hash of the event name
+        std::uint8_t priority;
+        system_tick_t enqueued;     // clock time when queued, see setClock()
+        system_tick_t sent;         // clock time when sent, 0 if it never was
+        system_tick_t completed;    // clock time when completed
+        int result;                 // particle::Error type of the outcome
+    };
+
     /**
      * @brief Creates the queues needed on construction, and stores them in the
      * _queues vector
@@ -51,24 +390,320 @@ public:
      * @details NUM_OF_QUEUES determines how many queues get created. Each queue
      * has a priority level determined by its index in the _queues vector. The
      * lower the index, the higher the priority
+     *
+     * @param[in] max_entries maximum number of events queued at each priority
+     * @param[in] max_payloads number of event data buffers shared by all
+     * queues, zero for one per queue entry. Deferred publishes don't use one,
+     * so this can be lowered when most events are deferred
+     * @param[in] max_isr_entries number of events publishFromISR() can stage
+     * before the publisher thread picks them up, zero to disable it
+     * @param[in] max_trace_records number of completed events trace()
+     * remembers, zero to disable tracing
      */
-    BackgroundPublish(std::size_t max_entries = 8u) : running {false}, _thread(), maxEntries {max_entries}  {}
+    BackgroundPublish(std::size_t max_entries = 8u,
+                      std::size_t max_payloads = 0u,
+                      std::size_t max_isr_entries = 0u,
+                      std::size_t max_trace_records = 0u) :
+        running {false},
+        _thread(),
+        _dispatchMode {dispatch_mode::INLINE},
+        _dispatcher(),
+        maxEntries {max_entries},
+        _eventCount {max_entries * NumQueues + 1}, // one more for the event being sent
+        _events(new publish_event_t[max_entries * NumQueues + 1]()),
+        _freeEvents(max_entries * NumQueues + 1),
+        _completions(max_entries * NumQueues + 1),
+        _payloads(new payload_t[max_payloads ? max_payloads : max_entries * NumQueues]),
+        _freePayloads(max_payloads ? max_payloads : max_entries * NumQueues),
+        _isrEntries(max_isr_entries ? new isr_entry_t[max_isr_entries] : nullptr),
+        _freeIsr(max_isr_entries),
+        _pendingIsr(max_isr_entries),
+        _trace(max_trace_records ? new trace_slot_t[max_trace_records]() : nullptr),
+        _traceSize {max_trace_records}
+    {
+        for (std::size_t i = 0; i < _eventCount; i++) {
+            _freeEvents.push(i);
+        }
+        // Room for stale entries left behind by cancel() and reprioritize()
+        for (auto &queue : _queues) {
+            queue = PublishRing<queue_entry_t>(_eventCount);
+        }
+        for (std::size_t i = 0; i < (max_payloads ? max_payloads : max_entries * NumQueues); i++) {
+            _freePayloads.push(_payloads[i].data);
+        }
+        for (std::size_t i = 0; i < max_isr_entries; i++) {
+            _freeIsr.push(i);
+        }
+        os_semaphore_create(&_space.semaphore, UINT16_MAX, 0);
+        os_semaphore_create(&_completion.semaphore, UINT16_MAX, 0);
+        os_semaphore_create(&_dispatchReady, UINT16_MAX, 0);
+        os_semaphore_create(&_wake, UINT16_MAX, 0);
+    }
+
+    ~BackgroundPublish()
+    {
+        if (running) {
+            stop();
+        }
+        os_semaphore_destroy(_space.semaphore);
+        os_semaphore_destroy(_completion.semaphore);
+        os_semaphore_destroy(_dispatchReady);
+        os_semaphore_destroy(_wake);
+    }
 
     /**
      * @brief Start the publisher
      *
-     * @details Creates the background publish thread
+     * @details Creates the background publish thread, unless the run mode is
+     * COOPERATIVE. Use workerStats() to find how much of the stack it uses.
      *
+     * @param[in] priority OS priority of the publisher thread. The EXECUTOR
+     * dispatcher runs one below it
+     * @param[in] stack_size stack size of the publisher thread in bytes
      */
-    void start();
+    void start(os_thread_prio_t priority = OS_THREAD_PRIORITY_DEFAULT,
+               std::size_t stack_size = OS_THREAD_STACK_SIZE_DEFAULT);
 
     /**
      * @brief Stop the publisher
      *
-     * @details Clean up the queues and stop the background publish thread
+     * @details Clean up the queues and stop the background publish thread.
+     * The thread is woken straight away. A publish still waiting for the
+     * cloud is abandoned and its callback is called with CANCELLED, so stop()
+     * doesn't wait for a round trip
      */
     void stop();
 
+    /**
+     * @brief Choose where completion callbacks are called
+     *
+     * @details With INLINE (the default) callbacks run on the publisher
+     * thread, or the thread calling cleanup() or cancel(), so a slow callback
+     * delays the next publish. EXECUTOR and MANUAL queue completed events and
+     * call their callbacks from a separate low priority thread or from
+     * dispatchCompletions(). An event holds its slot and data buffer until
+     * its callback has been dispatched. Evicted events give up the buffer
+     * straight away, and they and deferred events get empty event data.
+     * Rejected requests still call back straight away. Must be called
+     * before start().
+     *
+     * @param[in] mode dispatch mode
+     */
+    void setDispatchMode(dispatch_mode mode)
+    {
+        if (running) {
+            logger.warn("dispatch mode can't change on running publisher");
+            return;
+        }
+        _dispatchMode = mode;
+    }
+
+    /**
+     * @brief Choose between a publisher thread and calling process()
+     *
+     * @details COOPERATIVE saves the publisher thread and its stack. The
+     * application calls process() from loop() instead, which runs the same
+     * scheduler and rate limiter without blocking. Combine it with the INLINE
+     * or MANUAL dispatch mode to create no thread at all. Must be called
+     * before start().
+     *
+     * @param[in] mode run mode
+     */
+    void setRunMode(run_mode mode)
+    {
+        if (running) {
+            logger.warn("run mode can't change on running publisher");
+            return;
+        }
+        _runMode = mode;
+    }
+
+    /**
+     * @brief Where the publisher reads the time in milliseconds from
+     *
+     * @details The default is millis(). The rate limit, latency histograms,
+     * trace timestamps, diagnostics interval and log limits all follow this
+     * clock, so a simulation can run step() against a clock it advances
+     * itself and cover days of traffic in milliseconds. The publisher thread
+     * and blocking calls still sleep in real time. Must be called before
+     * start().
+     *
+     * @param[in] clock returns the current time in milliseconds
+     */
+    void setClock(clock_source clock)
+    {
+        if (running) {
+            logger.warn("clock can't change on running publisher");
+            return;
+        }
+        _clock = clock ? clock : default_clock;
+    }
+
+    /**
+     * @brief Run one pass of the publisher in COOPERATIVE run mode
+     *
+     * @details The same pass the publisher thread runs in THREADED mode. It
+     * completes the event being sent once the cloud has answered, and starts
+     * the next one when the rate limit allows. Never blocks.
+     *
+     * @return Milliseconds until another pass has something to do, 0 to call
+     * again straight away, CONCURRENT_WAIT_FOREVER until the next publish.
+     * Always CONCURRENT_WAIT_FOREVER if not started or in THREADED mode
+     */
+    system_tick_t step()
+    {
+        if (!running || _runMode != run_mode::COOPERATIVE) {
+            return CONCURRENT_WAIT_FOREVER;
+        }
+        return busy_step();
+    }
+
+    /**
+     * @brief Send queued events in COOPERATIVE run mode
+     *
+     * @details Call often, e.g. from loop(). Runs step() and doesn't block.
+     * Does nothing in THREADED run mode.
+     *
+     * @return TRUE while events are queued or being sent
+     */
+    bool process()
+    {
+        if (!running || _runMode != run_mode::COOPERATIVE) {
+            return false;
+        }
+        step();
+        if (_sending != nullptr || !_pendingIsr.empty()) {
+            return true;
+        }
+        // Unlike the occupancy mask, the depths leave out cancelled entries
+        for (auto &depth : _depth) {
+            if (depth != 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Call the callbacks of completed events queued by the EXECUTOR or
+     * MANUAL dispatch modes
+     *
+     * @return Number of callbacks called
+     */
+    std::size_t dispatchCompletions();
+
+    /**
+     * @brief Set the overflow policy of the queue at priority
+     *
+     * @details The default is DROP_NEWEST. With DROP_OLDEST the oldest event
+     * in the same queue is evicted to make room for the new one. With
+     * DROP_LOWEST_PRIORITY a full queue also evicts its own oldest event, and
+     * when the shared event data buffers run out the oldest event of the
+     * lowest priority queue (never a higher priority one) is evicted. The
+     * callback of an evicted event is called with BUSY, as if it had been
+     * rejected. publishBulk() in ALL_OR_NOTHING mode never evicts.
+     *
+     * @param[in] priority queue the policy applies to
+     * @param[in] policy overflow policy
+     */
+    void setOverflowPolicy(std::size_t priority, overflow_policy policy)
+    {
+        std::lock_guard<RecursiveMutex> lock(_mutex);
+        if (priority < NumQueues) {
+            _policies[priority] = policy;
+        }
+    }
+
+    /**
+     * @brief Get the counters of the queue at priority
+     *
+     * @details The counters are updated without locking, so a snapshot taken
+     * while publishing may be off by the requests in progress. Counts wrap
+     * around at 2^32. Resetting restarts the high water mark at the current
+     * depth, no count is lost between a snapshot and its reset.
+     *
+     * @param[in] priority queue to get the counters of
+     * @param[in] reset TRUE to zero the counters after taking the snapshot
+     * @return Counters, all zero if priority is out of range
+     */
+    publish_stats stats(std::size_t priority, bool reset = false);
+
+    /**
+     * @brief Publish a summary of the queues' health at an interval
+     *
+     * @details The publisher queues a deferred event named name at priority
+     * every interval, so it goes through the same rate limit as other events
+     * and renders the counters of stats() right before it is sent. For each
+     * queue, highest priority first and separated by ';', the data holds
+     * "depth,highWater,dropped,failed,waitP50,waitP99,netP50,netP99".
+     * dropped counts rejected and evicted events, failed the events that got
+     * an error from the cloud, and the percentiles are in milliseconds. No
+     * new summary is queued while the previous one is still queued. Must be
+     * called before start().
+     *
+     * @param[in] name of the diagnostic event
+     * @param[in] interval between summaries, zero to disable them
+     * @param[in] priority priority of the diagnostic event
+     * @param[in] flags PublishFlags type of the diagnostic event
+     */
+    void setDiagnostics(const char* name,
+                        std::chrono::milliseconds interval,
+                        std::size_t priority = NumQueues - 1,
+                        PublishFlags flags = PRIVATE)
+    {
+        if (running) {
+            logger.warn("diagnostics can't change on running publisher");
+            return;
+        }
+        std::strncpy(_diagnosticName, name, sizeof(_diagnosticName));
+        _diagnosticName[sizeof(_diagnosticName) - 1] = '\0';
+        _diagnosticInterval = interval.count();
+        _diagnosticPriority = priority;
+        _diagnosticFlags = flags;
+    }
+
+    /**
+     * @brief Get the busy and idle time and stack use of the publisher
+     *
+     * @details In COOPERATIVE mode the busy time is the time spent in
+     * process() and nothing is idle. Where FreeRTOS keeps a stack high water
+     * mark the stack use is taken from it. Otherwise the stack below the
+     * publisher thread's entry is painted with a pattern on start, leaving
+     * the bottom quarter of the configured size alone, and the thread
+     * measures how much of it was overwritten each time it goes idle. Frames
+     * above the entry are not counted and use reaching the unpainted quarter
+     * is not seen, so leave some headroom.
+     *
+     * @param[in] reset TRUE to zero the times after taking the snapshot
+     * @return Publisher overhead
+     */
+    worker_stats workerStats(bool reset = false)
+    {
+        worker_stats snapshot {};
+        snapshot.busyTime = reset ? _busyTime.exchange(0) : _busyTime.load();
+        snapshot.idleTime = reset ? _idleTime.exchange(0) : _idleTime.load();
+        snapshot.stackSize = _stackSize;
+        snapshot.stackUsed = _stackUsed;
+        return snapshot;
+    }
+
+    /**
+     * @brief Copy the most recently completed events, oldest first
+     *
+     * @details Recording is wait-free and runs whenever an event completes.
+     * A record being overwritten while it is copied is left out
+     *
+     * @param[out] records where to copy the records to
+     * @param[in] count maximum number of records to copy
+     * @return Number of records copied
+     */
+    std::size_t trace(trace_record* records, std::size_t count) const;
+
+    /**
+     * @brief Log the most recently completed events, oldest first
+     */
+    void dumpTrace() const;
+
     /**
      * @brief Request a publish message to the cloud
      *
@@ -84,13 +719,42 @@ public:
      * @param[in] priority priority of message. Lowest is highest priority, zero indexed
      * @param[in] cb callback on publish success or failure
      *
-     * @return TRUE if request accepted, FALSE if not
+     * @return Handle to the request, FALSE if not accepted
      */
-    bool publish(const char* name,
+    publish_handle publish(const char* name,
                  const char* data = nullptr,
                  PublishFlags flags = PRIVATE,
                  std::size_t priority = 0u,
-                 publish_callback cb = nullptr);
+                 publish_callback cb = nullptr)
+    {
+        return publish(name, data, flags, priority, cb, std::chrono::milliseconds::zero());
+    }
+
+    /**
+     * @brief Request a publish message to the cloud, waiting for space in a
+     * full queue
+     *
+     * @details Same as publish() except that when the queue at priority is
+     * full, the calling thread blocks until an entry is freed or timeout
+     * expires. The wait is signalled by the publisher, it doesn't poll.
+     * Must not be called from the publisher callbacks.
+     *
+     * @param[in] name of the event requested
+     * @param[in] data pointer to data to send
+     * @param[in] flags PublishFlags type for the request
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     * @param[in] cb callback on publish success or failure, TIMEOUT if no
+     * space was freed in time
+     * @param[in] timeout how long to wait for space in the queue
+     *
+     * @return Handle to the request, FALSE if not accepted
+     */
+    publish_handle publish(const char* name,
+                 const char* data,
+                 PublishFlags flags,
+                 std::size_t priority,
+                 publish_callback cb,
+                 std::chrono::milliseconds timeout);
 
     /**
      * @brief Wrapper class for callbacks that are for non-static functions
@@ -109,10 +773,10 @@ public:
      * @param[in] cb callback on publish success or failure
      * @param[in] instance pointer to instance of the class the cb belongs to
      *
-     * @return TRUE if request accepted, FALSE if not
+     * @return Handle to the request, FALSE if not accepted
      */
     template<typename T>
-    bool publish(const char* name,
+    publish_handle publish(const char* name,
                  const char* data = nullptr,
                  PublishFlags flags = PRIVATE,
                  std::size_t priority = 0u,
@@ -143,10 +807,10 @@ public:
      * @param[in] cb callback on publish success or failure
      * @param[in] context could be a pointer to class (*this)
      *
-     * @return TRUE if request accepted, FALSE if not
+     * @return Handle to the request, FALSE if not accepted
      */
     template<typename Context>
-    bool publish(const char* name,
+    publish_handle publish(const char* name,
                  const char* data = nullptr,
                  PublishFlags flags = PRIVATE,
                  std::size_t priority = 0u,
@@ -179,10 +843,10 @@ public:
      * @param[in] this invisible this pointer to the class the cb belongs to
      * @param[in] context could be a pointer to class (*this)
      *
-     * @return TRUE if request accepted, FALSE if not
+     * @return Handle to the request, FALSE if not accepted
      */
     template<typename T, typename Context>
-    bool publish(const char* name,
+    publish_handle publish(const char* name,
                  const char* data = nullptr,
                  PublishFlags flags = PRIVATE,
                  std::size_t priority = 0u,
@@ -199,186 +863,1976 @@ public:
     }
 
     /**
-     * @brief Iterate through the queues and make calls to the 
-     * callback functions
+     * @brief Request a publish message to the cloud and get a future for its
+     * completion instead of a callback
      *
-     * @details Will iterate through each queue taking an item from the queue
-     * and calling it's callback function with a status of CANCELLED.
-     * Intended for a user provided callback to potentially key off of this 
-     * CANCELLED and back up a publish to flash, or take an other
-     * meaningful action
+     * @param[in] name of the event requested
+     * @param[in] data pointer to data to send
+     * @param[in] flags PublishFlags type for the request
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     *
+     * @return Future for the outcome of the request. If it wasn't accepted
+     * the future is already done with the reason
      */
-    void cleanup();
-    
-    //remove copy and assignment operators
-    BackgroundPublish(BackgroundPublish const&) = delete; 
-    void operator=(BackgroundPublish const&)    = delete;
-
-protected:
-    // Define these as protected so the test case can access these to simulate the processing thread
-    struct publish_event_t {
-        PublishFlags event_flags;
-        publish_callback completed_cb;
-        char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
-        char event_data[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
-    };
-
-    std::array<std::queue<publish_event_t>, NumQueues> _queues;
-    static particle::Error process_publish(const publish_event_t& event);
-
-private:
-    void thread();
-
-    RecursiveMutex _mutex;
-    bool running;
-    Thread _thread;
-    std::size_t maxEntries;
+    publish_future publishAsync(const char* name,
+                                const char* data = nullptr,
+                                PublishFlags flags = PRIVATE,
+                                std::size_t priority = 0u);
 
-    static Logger logger;
-};
+    /**
+     * @brief Wait for a group of futures to complete
+     *
+     * @param[in] futures futures returned by publishAsync()
+     * @param[in] count number of futures
+     * @param[in] timeout how long to wait for all of them
+     *
+     * @return TRUE if every future is done
+     */
+    static bool waitAll(const publish_future* futures,
+                        std::size_t count,
+                        std::chrono::milliseconds timeout);
 
-template<std::size_t NumQueues>
-Logger BackgroundPublish<NumQueues>::logger("background-publish");
+    /**
+     * @brief Request a publish message whose data is rendered when it is sent
+     *
+     * @details Only the producer is queued. Right before the event is sent
+     * the producer renders the data into a buffer owned by the publisher, so
+     * the freshest value is published and queued events don't hold a copy
+     * of their data. The event data passed to cb is only valid during the
+     * callback, and is empty if the event never reached the producer.
+     *
+     * @param[in] name of the event requested
+     * @param[in] producer renders the event data at send time
+     * @param[in] flags PublishFlags type for the request
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     * @param[in] cb callback on publish success or failure
+     *
+     * @return Handle to the request, FALSE if not accepted
+     */
+    publish_handle publishDeferred(const char* name,
+                         payload_producer producer,
+                         PublishFlags flags = PRIVATE,
+                         std::size_t priority = 0u,
+                         publish_callback cb = nullptr);
 
-template<std::size_t NumQueues>
-void BackgroundPublish<NumQueues>::start()
+    /**
+     * @brief Request a publish message from an interrupt handler
+     *
+     * @details Copies the request into one of the entries reserved on
+     * construction using only atomic operations: no locks, allocation or
+     * logging. The publisher thread moves it into the queue at priority
+     * before its next send, where it is subject to the usual limits and
+     * overflow policy. cb and any logging run on the publisher thread.
+     * The other publish functions reject calls made from an interrupt with
+     * INVALID_STATE, without calling back or logging.
+     *
+     * @param[in] name of the event requested
+     * @param[in] data data of the event
+     * @param[in] flags PublishFlags type for the request
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     * @param[in] cb callback on publish success or failure
+     *
+     * @return TRUE if the request was staged, FALSE if all entries are in use
+     */
+    bool publishFromISR(const char* name,
+                        const char* data = nullptr,
+                        PublishFlags flags = PRIVATE,
+                        std::size_t priority = 0u,
+                        isr_callback cb = nullptr);
+
+    /**
+     * @brief Request a publish message with printf style event data
+     *
+     * @details The event data is formatted directly into the queued event,
+     * so the caller does not need to build the payload in a temporary
+     * buffer first. Data longer than MAX_EVENT_DATA_LENGTH is truncated.
+     *
+     * @param[in] name of the event requested
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     * @param[in] fmt printf style format string for the event data
+     *
+     * @return Length of the formatted data before truncation (like snprintf),
+     * or a negative system error code if the request was not accepted.
+     * A value greater than MAX_EVENT_DATA_LENGTH means the data was truncated
+     */
+    int publishf(const char* name, std::size_t priority, const char* fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+    /**
+     * @brief Request a publish message with printf style event data, flags
+     * and a callback
+     *
+     * @param[in] name of the event requested
+     * @param[in] flags PublishFlags type for the request
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     * @param[in] cb callback on publish success or failure
+     * @param[in] fmt printf style format string for the event data
+     * @param[in] args arguments for fmt
+     *
+     * @return Same as publishf()
+     */
+    int vpublishf(const char* name,
+                  PublishFlags flags,
+                  std::size_t priority,
+                  publish_callback cb,
+                  const char* fmt,
+                  va_list args);
+
+    /**
+     * @brief Request a publish message with JSON event data
+     *
+     * @details Calls fill with a JSONBufferWriter that writes directly into
+     * the queued event. Data longer than MAX_EVENT_DATA_LENGTH is truncated.
+     *
+     * @param[in] name of the event requested
+     * @param[in] fill callable taking a JSONWriter& that writes the event data
+     * @param[in] flags PublishFlags type for the request
+     * @param[in] priority priority of message. Lowest is highest priority, zero indexed
+     * @param[in] cb callback on publish success or failure
+     *
+     * @return Length of the JSON data before truncation, or a negative system
+     * error code if the request was not accepted
+     */
+    template<typename Fill>
+    int publishJson(const char* name,
+                    Fill fill,
+                    PublishFlags flags = PRIVATE,
+                    std::size_t priority = 0u,
+                    publish_callback cb = nullptr);
+
+    /**
+     * @brief Request several publish messages at once
+     *
+     * @details In ALL_OR_NOTHING mode the whole batch is reserved before any
+     * of it is handed to the publisher thread. Each request's result is set
+     * to NONE if it was queued,
+     * or the reason it wasn't. In ALL_OR_NOTHING mode, when one request
+     * can't be queued the others are rejected with CANCELLED, and queued
+     * events are never evicted to make room. The callback
+     * of every rejected request is called once the batch is processed.
+     *
+     * @param[in,out] requests events to publish
+     * @param[in] count number of requests
+     * @param[in] mode BEST_EFFORT or ALL_OR_NOTHING
+     *
+     * @return Number of requests accepted
+     */
+    std::size_t publishBulk(publish_request_t* requests,
+                            std::size_t count,
+                            bulk_mode mode = bulk_mode::BEST_EFFORT);
+
+    template<std::size_t N>
+    std::size_t publishBulk(publish_request_t (&requests)[N],
+                            bulk_mode mode = bulk_mode::BEST_EFFORT)
+    {
+        return publishBulk(requests, N, mode);
+    }
+
+    /**
+     * @brief Remove a queued event before it is sent
+     *
+     * @details The event's callback is called with CANCELLED. Events that
+     * are being sent or have completed can't be cancelled. O(1), the queue
+     * entry is skipped when the publisher reaches it.
+     *
+     * @param[in] handle returned by publish()
+     *
+     * @return TRUE if the event was cancelled
+     */
+    bool cancel(const publish_handle& handle);
+
+    /**
+     * @brief Current state of a publish request
+     *
+     * @param[in] handle returned by publish()
+     *
+     * @return QUEUED, SENDING, SENT, FAILED or CANCELLED, or UNKNOWN if the
+     * handle is invalid or its event slot has been reused
+     */
+    publish_status status(const publish_handle& handle);
+
+    /**
+     * @brief Move a queued event to the queue at another priority
+     *
+     * @details The event goes to the back of the new queue. Fails if the
+     * event isn't queued anymore or the new queue is full. O(1).
+     *
+     * @param[in] handle returned by publish()
+     * @param[in] priority new priority of the event
+     *
+     * @return TRUE if the event was moved
+     */
+    bool reprioritize(const publish_handle& handle, std::size_t priority);
+
+    /**
+     * @brief Iterate through the queues and make calls to the 
+     * callback functions
+     *
+     * @details Will iterate through each queue taking an item from the queue
+     * and calling it's callback function with a status of CANCELLED.
+     * Intended for a user provided callback to potentially key off of this 
+     * CANCELLED and back up a publish to flash, or take an other
+     * meaningful action. Callbacks run without the queue lock held, so they
+     * may publish again; events published after cleanup() starts are kept
+     */
+    void cleanup();
+    
+    //remove copy and assignment operators
+    BackgroundPublish(BackgroundPublish const&) = delete; 
+    void operator=(BackgroundPublish const&)    = delete;
+
+protected:
+    // Define these as protected so the test case can access these to simulate the processing thread
+    struct publish_event_t {
+        PublishFlags event_flags;
+        publish_callback completed_cb;
+        payload_producer producer; // set for deferred events
+        char event_name[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+        char *event_data; // buffer from _payloads, nullptr for deferred events
+        std::atomic<std::size_t> priority; // changed by reprioritize() holding both queue locks
+        std::atomic<std::uint32_t> ticket; // matches the live queue entry of a queued event
+        std::atomic<std::uint16_t> generation; // identifies the request in a publish_handle
+        std::uint8_t refs; // the publisher and a publish_future can hold the event
+        system_tick_t enqueued; // clock time when queued, for the queue wait
+        system_tick_t sent; // clock time when dequeued for sending
+        std::atomic<publish_status> state;
+        particle::Error result;
+    };
+
+    publish_event_t* dequeue();
+
+    // Pool levels, everything is back once the publisher has stopped
+    std::size_t free_events() const { return _freeEvents.size(); }
+    std::size_t free_payloads() const { return _freePayloads.size(); }
+
+private:
+    struct queue_entry_t {
+        std::uint32_t ticket;
+        std::uint16_t index;
+    };
+
+    static system_tick_t default_clock() { return millis(); }
+    void thread();
+    system_tick_t schedule();
+    system_tick_t busy_step();
+    void paint_stack(std::uintptr_t top);
+    void probe_stack();
+    std::size_t stack_margin() const;
+    std::uintptr_t stack_bottom() const;
+    bool send(publish_event_t& event);
+    void finish(particle::Error error);
+    void abandon();
+    void idle(system_tick_t timeout);
+    void wake();
+    bool pending() const
+    {
+        return _occupied != 0 || !_pendingIsr.empty();
+    }
+    void dispatcher();
+    void drain_isr();
+    void cancel_isr();
+    particle::Error reserve(const char* name,
+                            PublishFlags flags,
+                            std::size_t priority,
+                            const publish_callback& cb,
+                            bool with_payload,
+                            publish_event_t*& event,
+                            bool evicting = true);
+    particle::Error enqueue(publish_event_t& event);
+    void unreserve(publish_event_t& event);
+    bool claim(std::size_t priority);
+    void unclaim(std::size_t priority);
+    bool evict(std::size_t priority, bool queue_full);
+    publish_event_t* front(std::size_t priority);
+    publish_event_t* lookup(const publish_handle& handle, publish_status& state);
+    publish_handle handle_of(const publish_event_t* event);
+    bool complete(publish_event_t& event, particle::Error error, const char* data);
+    void release(publish_event_t& event);
+    void reject(std::size_t priority,
+                const publish_callback& cb,
+                particle::Error error,
+                const char* name,
+                const char* data);
+    void count_outcome(std::size_t priority, particle::Error error);
+    void record_trace(const publish_event_t& event, particle::Error error);
+
+    // Log sites that can repeat for every request during a flood
+    enum class log_site {
+        TRUNCATED,
+        SEND_FAILED,
+        NOT_RUNNING,
+        BAD_PRIORITY,
+        QUEUE_FULL,
+        NO_BUFFERS,
+        NO_EVENTS,
+        EVICTING,
+        BATCH,
+        COUNT
+    };
+    bool log_allowed(log_site site);
+    void roll_log(log_site site, system_tick_t now);
+    system_tick_t flush_logs();
+    system_tick_t diagnose();
+    int render_diagnostic(char* data, std::size_t size);
+    bool read_trace(std::uint32_t n, trace_record& record) const;
+    using latency_buckets_t = std::array<std::atomic<std::uint32_t>, latency_buckets>;
+    static void record(latency_buckets_t& buckets, system_tick_t latency);
+    static latency_histogram take(latency_buckets_t& buckets, bool reset);
+
+    bool future_done(std::uint16_t index, particle::Error* error);
+    bool future_wait(std::uint16_t index, std::chrono::milliseconds timeout);
+    void future_on_done(std::uint16_t index, const publish_callback& cb);
+    void future_release(std::uint16_t index);
+
+    // Threads blocked until room or a completion shows up. A waiter counts
+    // itself in before checking its condition, so a signal() after the check
+    // can't be missed
+    struct wait_list_t {
+        os_semaphore_t semaphore {nullptr};
+        std::atomic<std::size_t> waiters {0};
+    };
+    bool wait(wait_list_t& list, system_tick_t timeout);
+    void signal(wait_list_t& list);
+    std::unique_lock<RecursiveMutex> lock_queue(publish_event_t& event);
+    static bool is_done(publish_status state)
+    {
+        return state == publish_status::SENT ||
+               state == publish_status::FAILED ||
+               state == publish_status::CANCELLED;
+    }
+    static void copy_data(char* event_data, const char* data);
+    static void notify(const publish_callback& cb,
+                       particle::Error error,
+                       const char* name,
+                       const char* data);
+
+    RecursiveMutex _mutex; // guards completed events shared with futures and the dispatcher
+    std::atomic<bool> running;
+    run_mode _runMode {run_mode::THREADED};
+    clock_source _clock {default_clock};
+    Thread _thread;
+    os_semaphore_t _wake; // given by stop(), and by enqueue() when the thread is idle
+    std::atomic<bool> _idle {false};
+    dispatch_mode _dispatchMode;
+    Thread _dispatcher;
+    os_semaphore_t _dispatchReady;
+    std::size_t maxEntries;
+    std::array<std::atomic<overflow_policy>, NumQueues> _policies {};
+
+    // Events live in a fixed pool, the queues hold their indices
+    std::size_t _eventCount;
+    std::unique_ptr<publish_event_t[]> _events;
+    PublishRing<std::uint16_t> _freeEvents;
+    std::array<PublishRing<queue_entry_t>, NumQueues> _queues;
+    std::array<RecursiveMutex, NumQueues> _queueLocks; // serialize the consumers of each queue, producers don't take them
+    std::atomic<std::uint32_t> _occupied {0}; // bit per queue that may hold entries
+    std::array<std::atomic<std::size_t>, NumQueues> _depth {}; // queued events, excluding stale entries
+    std::array<std::size_t, NumQueues> _detached {}; // queue position up to which cleanup() owns the entries, under _queueLocks
+    std::array<std::size_t, NumQueues> _detaching {}; // cleanup() calls using _detached, under _queueLocks
+    PublishRing<std::uint16_t> _completions; // events waiting for their callback to be dispatched
+
+    // Updated with relaxed atomics, they only need to add up eventually
+    struct stats_counters_t {
+        std::atomic<std::size_t> highWater {0};
+        std::atomic<std::uint32_t> enqueued {0};
+        std::atomic<std::uint32_t> sent {0};
+        std::atomic<std::uint32_t> rejected {0};
+        std::atomic<std::uint32_t> cancelled {0};
+        std::atomic<std::uint32_t> evicted {0};
+        std::atomic<std::uint32_t> limited {0};
+        std::atomic<std::uint32_t> timedOut {0};
+        std::atomic<std::uint32_t> failed {0};
+        latency_buckets_t queueWait {};
+        latency_buckets_t network {};
+    };
+    std::array<stats_counters_t, NumQueues> _stats;
+
+    struct payload_t {
+        char data[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    };
+    wait_list_t _space; // publish() calls waiting for room in a queue
+    wait_list_t _completion; // futures waiting for their event to complete
+
+    std::unique_ptr<payload_t[]> _payloads;
+    PublishRing<char*> _freePayloads;
+
+    // Requests staged by publishFromISR() until the publisher thread queues them
+    struct isr_entry_t {
+        PublishFlags flags;
+        std::size_t priority;
+        isr_callback cb;
+        char name[particle::protocol::MAX_EVENT_NAME_LENGTH + 1];
+        char data[particle::protocol::MAX_EVENT_DATA_LENGTH + 1];
+    };
+    std::unique_ptr<isr_entry_t[]> _isrEntries;
+    PublishRing<std::uint16_t> _freeIsr;
+    PublishRing<std::uint16_t> _pendingIsr;
+    std::atomic<std::size_t> _isrDropped {0}; // rejected for lack of entries, logged later
+
+    // Ring of the last completed events. Writers take a number from a counter
+    // and own its slot by moving the sequence from an older even value to an
+    // odd one, so readers can skip torn or overwritten records
+    struct trace_slot_t {
+        std::atomic<std::uint32_t> sequence;
+        std::atomic<std::uint32_t> nameHash;
+        std::atomic<std::uint8_t> priority;
+        std::atomic<system_tick_t> enqueued;
+        std::atomic<system_tick_t> sent;
+        std::atomic<system_tick_t> completed;
+        std::atomic<int> result;
+    };
+    std::unique_ptr<trace_slot_t[]> _trace;
+    std::size_t _traceSize;
+    std::atomic<std::uint32_t> _traceNext {0};
+    char _scratch[particle::protocol::MAX_EVENT_DATA_LENGTH + 1]; // deferred event data
+
+    // Scheduler state, only used by the publisher thread or process()
+    static constexpr std::size_t burst_rate {2u}; // allowable burst rate (Hz), Device OS allows up to 4/s
+    static constexpr system_tick_t process_interval {1000u};
+    static constexpr system_tick_t poll_interval {2u}; // while waiting for the cloud
+    static constexpr system_tick_t retry_interval {2u}; // while only stale entries are queued
+    system_tick_t _sendTimes[burst_rate] {}; // send time of the last (burst_rate) sends in a circular buffer
+    std::size_t _sendIndex {}; // send time of the previous (burst_rate)th send
+    publish_event_t* _sending {nullptr};
+    const char* _sendingData {nullptr};
+    particle::Future<bool> _promise;
+
+    // Publisher overhead, see workerStats()
+    static constexpr std::uint32_t stack_paint {0xa5a5a5a5u};
+    static constexpr std::size_t stack_reserve {512u}; // least left unpainted for frames above thread() and headroom
+    std::atomic<std::uint32_t> _busyTime {0};
+    std::atomic<std::uint32_t> _idleTime {0};
+    std::uint32_t _busyMicros {}; // busy time not added to _busyTime yet
+    std::size_t _stackSize {};
+    std::uintptr_t _stackTop {}; // stack pointer at the entry of thread()
+    std::uintptr_t _stackClean {}; // end of the painted words not overwritten yet
+    std::atomic<std::size_t> _stackUsed {0};
+
+    // Periodic health summary, see setDiagnostics()
+    char _diagnosticName[particle::protocol::MAX_EVENT_NAME_LENGTH + 1] {};
+    PublishFlags _diagnosticFlags;
+    std::size_t _diagnosticPriority {};
+    system_tick_t _diagnosticInterval {}; // zero when disabled
+    system_tick_t _diagnosticAt {}; // when the last summary was due
+    std::atomic<bool> _diagnosticQueued {false};
+
+    // Each log site logs its first log_burst messages per log_window, then
+    // sums up how many it suppressed when the next window opens
+    static constexpr std::uint32_t log_burst {3u};
+    static constexpr system_tick_t log_window {10000u};
+    struct log_limit_t {
+        std::atomic<system_tick_t> window {0};
+        std::atomic<std::uint32_t> count {0};
+        std::atomic<std::uint32_t> suppressed {0};
+    };
+    std::array<log_limit_t, (std::size_t)log_site::COUNT> _logLimits;
+
+    static Logger logger;
+};
+
+template<std::size_t NumQueues, typename Hooks>
+Logger BackgroundPublish<NumQueues, Hooks>::logger("background-publish");
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::start(os_thread_prio_t priority, std::size_t stack_size)
 {
-    if (running) {
+    if (running.exchange(true)) {
         logger.warn("start() called on running publisher");
         return;
     }
-    running = true;
-    _thread = Thread("background_publish",
-                     std::bind(&BackgroundPublish::thread, this),
-                     OS_THREAD_PRIORITY_DEFAULT);
+    _diagnosticAt = _clock();
+    _stackSize = 0;
+    _stackUsed = 0;
+    if (_runMode == run_mode::THREADED) {
+        _stackSize = stack_size;
+        _thread = Thread("background_publish",
+                         std::bind(&BackgroundPublish::thread, this),
+                         priority,
+                         stack_size);
+    }
+    if (_dispatchMode == dispatch_mode::EXECUTOR) {
+        // Below the publisher so callbacks never hold up a send, but not
+        // below the lowest priority, 0
+        _dispatcher = Thread("background_dispatch",
+                             std::bind(&BackgroundPublish::dispatcher, this),
+                             priority > 0 ? priority - 1 : 0);
+    }
 }
 
-template<std::size_t NumQueues>
-void BackgroundPublish<NumQueues>::stop()
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::stop()
 {
-    if (!running) {
+    if (!running.exchange(false)) {
         logger.warn("stop() called on non-running publisher");
         return;
     }
-    running = false;
-    _thread.join();
+    if (_runMode == run_mode::THREADED) {
+        os_semaphore_give(_wake, false);
+        _thread.join();
+    }
+    abandon();
+    cancel_isr();
     cleanup();
+    if (_dispatchMode == dispatch_mode::EXECUTOR) {
+        os_semaphore_give(_dispatchReady, false);
+        _dispatcher.join();
+    }
+    // Nothing is left to call back on the completions
+    dispatchCompletions();
 }
 
-template<std::size_t NumQueues>
-particle::Error BackgroundPublish<NumQueues>::process_publish(const publish_event_t& event)
+// Renders deferred data and hands the event to the cloud. Returns FALSE if
+// the event was completed without being sent
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::send(publish_event_t& event)
 {
-    auto promise {Particle.publish(event.event_name,
-                                   event.event_data,
-                                   event.event_flags)};
+    _sending = &event;
+    _sendingData = event.event_data;
 
-    // Can't use promise.wait() outside of the application thread
-    while(!promise.isDone()) {
-        delay(2); // yield to other threads
+    if (event.producer != nullptr) {
+        // Deferred event, render the data now so the freshest value is sent
+        _sendingData = _scratch;
+        auto len {event.producer(_scratch, sizeof(_scratch))};
+        _scratch[sizeof(_scratch) - 1] = '\0';
+        if (len < 0) {
+            _scratch[0] = '\0';
+            finish(particle::Error::CANCELLED);
+            return false;
+        } else if ((std::size_t)len > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+            if (log_allowed(log_site::TRUNCATED)) {
+                logger.warn("event data truncated from %d bytes", len);
+            }
+        }
     }
-    auto error {promise.error()};
 
-    if(event.completed_cb != nullptr) {
-        event.completed_cb(error,
-                           event.event_name,
-                           event.event_data);
-    } else {
+    Hooks::onSend(event.event_name, _sendingData, event.priority);
+    // Can't use promise.wait() outside of the application thread, schedule()
+    // polls it instead
+    _promise = Particle.publish(event.event_name,
+                                _sendingData,
+                                event.event_flags);
+    return true;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::finish(particle::Error error)
+{
+    auto event {_sending};
+    _sending = nullptr;
+
+    if(!complete(*event, error, _sendingData)) {
         if (error != particle::Error::NONE) {
             // log error if no callback is used
-            logger.error("publish failed: %s", error.message());
+            if (log_allowed(log_site::SEND_FAILED)) {
+                logger.error("publish failed: %s", error.message());
+            }
+        }
+    }
+}
+
+// Hands the event being sent back as CANCELLED, unless the cloud has
+// answered already
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::abandon()
+{
+    if (_sending == nullptr) {
+        return;
+    }
+    if (_promise.isDone()) {
+        finish(_promise.error());
+    } else {
+        _promise.cancel();
+        finish(particle::Error::CANCELLED);
+    }
+}
+
+// One non-blocking scheduling pass shared by the publisher thread and
+// process(). Completes the event being sent once the cloud has answered, and
+// starts the next one if the rate limit allows. Returns how long there is
+// nothing to do for, zero to call again straight away
+template<std::size_t NumQueues, typename Hooks>
+system_tick_t BackgroundPublish<NumQueues, Hooks>::schedule()
+{
+    // Every pass frees the interrupt entries, not only those that send
+    drain_isr();
+    auto diagnostic_due {diagnose()};
+    auto log_due {flush_logs()};
+    if(_sending == nullptr) {
+        // The occupancy mask is read without locking, an idle pass takes no lock
+        if(!pending()) {
+            return diagnostic_due < log_due ? diagnostic_due : log_due;
+        }
+        auto now {_clock()};
+        auto elapsed {now - _sendTimes[_sendIndex]};
+        if(elapsed < process_interval) {
+            return process_interval - elapsed;
+        }
+        auto event {dequeue()};
+        if(event == nullptr) {
+            return retry_interval; // only stale or detached entries left
         }
+        Hooks::onDequeue(event->event_name, event->priority);
+        record(_stats[event->priority].queueWait, now - event->enqueued);
+        event->sent = now;
+        _sendTimes[_sendIndex] = now;
+        _sendIndex = (_sendIndex + 1) % burst_rate;
+        if(!send(*event)) {
+            return 0;
+        }
+    }
+
+    if(!_promise.isDone()) {
+        return poll_interval;
     }
+    record(_stats[_sending->priority].network, _clock() - _sending->sent);
+    finish(_promise.error());
+    return 0;
+}
 
-    return error;
+// Queues the health summary when it is due. Returns how long until the next
+// one is due
+template<std::size_t NumQueues, typename Hooks>
+system_tick_t BackgroundPublish<NumQueues, Hooks>::diagnose()
+{
+    if(_diagnosticInterval == 0) {
+        return CONCURRENT_WAIT_FOREVER;
+    }
+    auto elapsed {_clock() - _diagnosticAt};
+    if(elapsed < _diagnosticInterval) {
+        return _diagnosticInterval - elapsed;
+    }
+    _diagnosticAt += elapsed;
+    if(!_diagnosticQueued.exchange(true)) {
+        // The callback also runs if the summary is rejected or cancelled
+        publishDeferred(_diagnosticName,
+                        [this](char* data, std::size_t size) {
+                            return render_diagnostic(data, size);
+                        },
+                        _diagnosticFlags,
+                        _diagnosticPriority,
+                        [this](particle::Error, const char*, const char*) {
+                            _diagnosticQueued = false;
+                        });
+    }
+    return _diagnosticInterval;
 }
 
-template<std::size_t NumQueues>
-void BackgroundPublish<NumQueues>::thread() {
-    constexpr std::size_t burst_rate {2u}; // allowable burst rate (Hz), Device OS allows up to 4/s
-    constexpr system_tick_t process_interval {1000u};
+template<std::size_t NumQueues, typename Hooks>
+int BackgroundPublish<NumQueues, Hooks>::render_diagnostic(char* data, std::size_t size)
+{
+    int len {};
+    for(std::size_t priority = 0; priority < NumQueues; priority++) {
+        auto s {stats(priority)};
+        auto ret {std::snprintf(data + std::min<std::size_t>(len, size),
+                                size - std::min<std::size_t>(len, size),
+                                "%s%u,%u,%lu,%lu,%lu,%lu,%lu,%lu",
+                                priority ? ";" : "",
+                                (unsigned)s.depth,
+                                (unsigned)s.highWater,
+                                (unsigned long)(s.rejected + s.evicted),
+                                (unsigned long)(s.limited + s.timedOut + s.failed),
+                                (unsigned long)s.queueWait.percentile(50),
+                                (unsigned long)s.queueWait.percentile(99),
+                                (unsigned long)s.network.percentile(50),
+                                (unsigned long)s.network.percentile(99))};
+        if(ret < 0) {
+            return ret;
+        }
+        len += ret;
+    }
+    return len;
+}
 
-    system_tick_t publish_t[burst_rate] {}; // publish time of the last (burst_rate) sends in a circular buffer
-    std::size_t i {}; // publish time of the previous (burst_rate)th send
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::thread() {
+    std::uint32_t entry {};
+    paint_stack((std::uintptr_t)&entry);
 
     while(running) {
-        auto now {millis()};
-        if(now - publish_t[i] >= process_interval) {
-            for(auto &queue : _queues) {
-                _mutex.lock();
-                if(!queue.empty()) {
-                    publish_t[i] = now;
-                    i = (i + 1) % burst_rate;
-                    // Copy the event and pop so the publish and wait is done without holding the mutex
-                    publish_event_t event {queue.front()};
-                    queue.pop();
-                    _mutex.unlock();
-                    process_publish(event);
-                    break;
-                }
-                _mutex.unlock();
-            }
+        auto timeout {busy_step()};
+        if(timeout != 0) {
+            probe_stack();
+            auto start {millis()};
+            idle(timeout);
+            _idleTime.fetch_add(millis() - start, std::memory_order_relaxed);
         }
+    }
+}
+
+template<std::size_t NumQueues, typename Hooks>
+system_tick_t BackgroundPublish<NumQueues, Hooks>::busy_step()
+{
+    auto start {micros()};
+    auto timeout {schedule()};
+    // Whole milliseconds only, so the count stays 32 bits
+    _busyMicros += micros() - start;
+    _busyTime.fetch_add(_busyMicros / 1000u, std::memory_order_relaxed);
+    _busyMicros %= 1000u;
+    return timeout;
+}
+
+// Neither the frames of the thread wrapper above the entry of thread() nor
+// where the RTOS put the stack base are known, so a quarter of the configured
+// size, and at least stack_reserve, is never painted
+template<std::size_t NumQueues, typename Hooks>
+std::size_t BackgroundPublish<NumQueues, Hooks>::stack_margin() const
+{
+    return _stackSize / 4u > stack_reserve ? _stackSize / 4u : stack_reserve;
+}
+
+// Lowest address painted
+template<std::size_t NumQueues, typename Hooks>
+std::uintptr_t BackgroundPublish<NumQueues, Hooks>::stack_bottom() const
+{
+    return (_stackTop - _stackSize + stack_margin() + 3u) & ~(std::uintptr_t)3u;
+}
 
-        delay(2); // force yield to processor
+// Fills the unused part of the stack below top with a pattern, down to
+// stack_bottom() and leaving room for the frames of this function
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::paint_stack(std::uintptr_t top)
+{
+    _stackTop = top;
+    _stackClean = 0;
+#if !(defined(INCLUDE_uxTaskGetStackHighWaterMark) && INCLUDE_uxTaskGetStackHighWaterMark)
+    std::uint32_t here {};
+    auto end {((std::uintptr_t)&here - 64u) & ~(std::uintptr_t)3u};
+    if (_stackSize < stack_margin() + (top - end) + sizeof(std::uint32_t)) {
+        return; // too small to tell anything
     }
+    for (auto p = stack_bottom(); p < end; p += sizeof(std::uint32_t)) {
+        *(volatile std::uint32_t*)p = stack_paint;
+    }
+    _stackClean = end;
+#endif
+    probe_stack();
 }
 
-template<std::size_t NumQueues>
-bool BackgroundPublish<NumQueues>::publish(const char *name,
-                                           const char *data,
-                                           PublishFlags flags,
-                                           std::size_t priority,
-                                           publish_callback cb)
+// The stack grows down, the deepest use is the lowest overwritten word.
+// Where FreeRTOS keeps a high water mark for the thread, that is used instead
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::probe_stack()
+{
+#if defined(INCLUDE_uxTaskGetStackHighWaterMark) && INCLUDE_uxTaskGetStackHighWaterMark
+    auto unused {(std::size_t)uxTaskGetStackHighWaterMark(nullptr) * sizeof(StackType_t)};
+    _stackUsed = _stackSize > unused ? _stackSize - unused : 0u;
+#else
+    auto p {_stackClean};
+    auto bottom {stack_bottom()};
+    if (_stackSize == 0 || p <= bottom) {
+        return;
+    }
+    // Scan up from the bottom, the paint above the old mark is gone already
+    auto low {bottom};
+    while (low < p && *(volatile std::uint32_t*)low == stack_paint) {
+        low += sizeof(std::uint32_t);
+    }
+    _stackClean = low;
+    _stackUsed = _stackTop - low;
+#endif
+}
+
+// Sleeps until there is something to send, stop() is called or timeout
+// expires. Announcing the sleep before checking again means an enqueue after
+// the check will wake it
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::idle(system_tick_t timeout)
+{
+    _idle = true;
+    if(timeout != CONCURRENT_WAIT_FOREVER || !pending()) {
+        os_semaphore_take(_wake, timeout, false);
+    }
+    _idle = false;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::wake()
 {
+    if(_idle.exchange(false)) {
+        os_semaphore_give(_wake, false);
+    }
+}
+
+// Takes the event at the front of the highest priority non-empty queue and
+// marks it as being sent. Returns nullptr if all queues are empty
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_event_t* BackgroundPublish<NumQueues, Hooks>::dequeue()
+{
+    // Visit only the occupied queues, highest priority (lowest bit) first.
+    // A queue whose bit is stale is skipped and front() clears the bit
+    std::uint32_t occupied {_occupied};
+    for(; occupied != 0; occupied &= occupied - 1) {
+        std::size_t priority = __builtin_ctz(occupied);
+        std::lock_guard<RecursiveMutex> lock(_queueLocks[priority]);
+        auto event {front(priority)};
+        if(event != nullptr) {
+            queue_entry_t entry;
+            _queues[priority].pop(entry);
+            _depth[priority]--;
+            event->state = publish_status::SENDING;
+            signal(_space);
+            return event;
+        }
+    }
+
+    return nullptr;
+}
+
+// Moves requests staged by publishFromISR() into the queues. Runs on the
+// publisher thread, so rejections are logged and called back from here
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::drain_isr()
+{
+    auto dropped {_isrDropped.exchange(0)};
+    if (dropped) {
+        logger.warn("%u events published from interrupts were dropped", (unsigned)dropped);
+    }
+
+    std::uint16_t index;
+    while (_pendingIsr.pop(index)) {
+        auto &entry {_isrEntries[index]};
+        publish(entry.name, entry.data, entry.flags, entry.priority, entry.cb);
+        if (!_freeIsr.push(index)) {
+            logger.error("interrupt entry %u lost", (unsigned)index);
+        }
+    }
+}
+
+// Calls back requests staged by publishFromISR() that were never queued and
+// frees their entries. Runs from stop() once the publisher thread is gone
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::cancel_isr()
+{
+    std::uint16_t index;
+    while (_pendingIsr.pop(index)) {
+        auto &entry {_isrEntries[index]};
+        notify(entry.cb, particle::Error::CANCELLED, entry.name, entry.data);
+        if (!_freeIsr.push(index)) {
+            logger.error("interrupt entry %u lost", (unsigned)index);
+        }
+    }
+}
+
+// Returns the oldest queued event at priority without removing it, dropping
+// stale entries left behind by cancel() and reprioritize() on the way.
+// Must be called with the queue lock held, which makes this the only consumer
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_event_t* BackgroundPublish<NumQueues, Hooks>::front(std::size_t priority)
+{
+    queue_entry_t entry;
+    do {
+        while(_queues[priority].front(entry)) {
+            auto &event {_events[entry.index]};
+            if(event.ticket == entry.ticket && event.state == publish_status::QUEUED) {
+                // Events detached by cleanup() stay ahead of newer ones until drained
+                // Positions wrap, so compare their distance
+                return (_detaching[priority] == 0 ||
+                        (std::ptrdiff_t)(_queues[priority].popped() - _detached[priority]) >= 0) ? &event : nullptr;
+            }
+            _queues[priority].pop(entry);
+        }
+        // Producers set the bit after pushing, so one racing with this either
+        // sets it again or its entry is seen by the look below
+        _occupied &= ~(1u << priority);
+        if(!_queues[priority].front(entry)) {
+            return nullptr;
+        }
+        _occupied |= 1u << priority;
+    } while(true);
+}
+
+// Takes a free event and a place in the queue at priority for a new request.
+// Lock free unless the overflow policy has to evict. The event only becomes
+// visible to the worker once it is passed to enqueue(), so the caller can
+// fill in its data first
+template<std::size_t NumQueues, typename Hooks>
+particle::Error BackgroundPublish<NumQueues, Hooks>::reserve(const char *name,
+                                                      PublishFlags flags,
+                                                      std::size_t priority,
+                                                      const publish_callback& cb,
+                                                      bool with_payload,
+                                                      publish_event_t*& event,
+                                                      bool evicting)
+{
+    if (HAL_IsISR()) {
+        // Can't lock or log here, publishFromISR() is the interrupt safe path
+        return particle::Error::INVALID_STATE;
+    }
+
     if (!running) {
-        logger.error("publisher not initialized");
-        cb(particle::Error::INVALID_STATE, name, data);
-        return false;
+        if (log_allowed(log_site::NOT_RUNNING)) {
+            logger.error("publisher not initialized");
+        }
+        return particle::Error::INVALID_STATE;
     }
 
     if (priority >= NumQueues) {
-        logger.error("priority %d exceeds number of queues %d", priority, NumQueues);
-        cb(particle::Error::INVALID_ARGUMENT, name, data);
-        return false;
+        if (log_allowed(log_site::BAD_PRIORITY)) {
+            logger.error("priority %d exceeds number of queues %d", priority, NumQueues);
+        }
+        return particle::Error::INVALID_ARGUMENT;
     }
 
-    std::lock_guard<RecursiveMutex> lock(_mutex);
+    while(!claim(priority)) {
+        if (!evicting || !evict(priority, true)) {
+            if (log_allowed(log_site::QUEUE_FULL)) {
+                logger.error("queue at priority %d is full", priority);
+            }
+            return particle::Error::BUSY;
+        }
+    }
 
-    if(_queues[priority].size() >= maxEntries) {
-        logger.error("queue at priority %d is full", priority);
-        cb(particle::Error::BUSY, name, data);
-        return false;
+    char *data {nullptr};
+    while (with_payload && !_freePayloads.pop(data)) {
+        if (!evicting || !evict(priority, false)) {
+            if (log_allowed(log_site::NO_BUFFERS)) {
+                logger.error("no event data buffers available");
+            }
+            unclaim(priority);
+            return particle::Error::BUSY;
+        }
     }
-    _queues[priority].emplace();
-    auto &event {_queues[priority].back()};
-    event.event_flags = flags;
-    event.completed_cb = cb;
-    std::strncpy(event.event_name, name, sizeof(event.event_name));
-    event.event_name[sizeof(event.event_name) - 1] = '\0';
-    if (data != nullptr) {
-        std::strncpy(event.event_data, data, sizeof(event.event_data));
-        event.event_data[sizeof(event.event_data) - 1] = '\0';
-    } else {
-        event.event_data[0] = '\0';
+
+    std::uint16_t index;
+    if (!_freeEvents.pop(index)) {
+        if (log_allowed(log_site::NO_EVENTS)) {
+            logger.error("no events available at priority %d", priority);
+        }
+        if (data != nullptr && !_freePayloads.push(data)) {
+            logger.error("event data buffer lost");
+        }
+        unclaim(priority);
+        return particle::Error::BUSY;
+    }
+    // The generation goes first so lookup() can tell a handle to the
+    // previous request from this one
+    event = &_events[index];
+    event->generation++;
+    event->event_flags = flags;
+    event->completed_cb = cb;
+    event->producer = nullptr;
+    event->event_data = data;
+    std::strncpy(event->event_name, name, sizeof(event->event_name));
+    event->event_name[sizeof(event->event_name) - 1] = '\0';
+    event->priority = priority;
+    event->ticket++;
+    event->refs = 1;
+    event->result = particle::Error::UNKNOWN;
+    event->sent = 0;
+    event->state = publish_status::QUEUED;
+
+    return particle::Error::NONE;
+}
+
+// Publishes a reserved event to the worker. Stale entries can leave no room
+// in the queue, the reservation is undone then
+template<std::size_t NumQueues, typename Hooks>
+particle::Error BackgroundPublish<NumQueues, Hooks>::enqueue(publish_event_t& event)
+{
+    std::size_t priority {event.priority};
+    event.enqueued = _clock();
+    Hooks::onEnqueue(event.event_name, priority);
+    queue_entry_t entry {event.ticket, (std::uint16_t)(&event - _events.get())};
+    auto pushed {_queues[priority].push(entry)};
+    if (!pushed) {
+        // Stale entries left behind a live one can fill the queue, drop any
+        // that have reached the front and try again
+        std::lock_guard<RecursiveMutex> lock(_queueLocks[priority]);
+        front(priority);
+        pushed = _queues[priority].push(entry);
+    }
+    if (!pushed) {
+        if (log_allowed(log_site::NO_EVENTS)) {
+            logger.error("no events available at priority %d", priority);
+        }
+        unreserve(event);
+        return particle::Error::BUSY;
     }
+    _occupied |= 1u << priority;
+    _stats[priority].enqueued.fetch_add(1, std::memory_order_relaxed);
+    wake();
+    return particle::Error::NONE;
+}
+
+// Returns a reserved event that was never handed to the caller to the pools.
+// If its entry was already pushed the caller holds the queue lock
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::unreserve(publish_event_t& event)
+{
+    event.ticket++; // in case its entry was already pushed
+    event.state = publish_status::CANCELLED;
+    event.completed_cb = nullptr;
+    event.refs = 1;
+    unclaim(event.priority);
+    release(event);
+}
+
+// Counts a new event against the queue at priority, failing if it is full
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::claim(std::size_t priority)
+{
+    auto depth {_depth[priority].load()};
+    do {
+        if (depth >= maxEntries) {
+            return false;
+        }
+    } while (!_depth[priority].compare_exchange_weak(depth, depth + 1));
 
+    auto &highWater {_stats[priority].highWater};
+    auto mark {highWater.load(std::memory_order_relaxed)};
+    while (mark <= depth &&
+           !highWater.compare_exchange_weak(mark, depth + 1, std::memory_order_relaxed)) {
+    }
     return true;
 }
 
-template<std::size_t NumQueues>
-void BackgroundPublish<NumQueues>::cleanup()
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::unclaim(std::size_t priority)
 {
-    std::lock_guard<RecursiveMutex> lock(_mutex);
+    _depth[priority]--;
+    signal(_space);
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::copy_data(char *event_data, const char *data)
+{
+    if (data != nullptr) {
+        std::strncpy(event_data, data, sizeof(payload_t::data));
+        event_data[sizeof(payload_t::data) - 1] = '\0';
+    } else {
+        event_data[0] = '\0';
+    }
+}
+
+// Applies the overflow policy of the queue at priority, evicting one event to
+// make room for a new one. queue_full is set when the queue itself is full,
+// otherwise a data buffer is needed
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::evict(std::size_t priority, bool queue_full)
+{
+    overflow_policy policy {_policies[priority]};
+    if (policy == overflow_policy::DROP_NEWEST) {
+        return false;
+    }
+
+    // Only evicting from the full queue itself makes room in it. Otherwise
+    // look for the oldest event that holds a data buffer
+    auto first {!queue_full && policy == overflow_policy::DROP_LOWEST_PRIORITY ? NumQueues - 1 : priority};
+    auto victim {first};
+    std::unique_lock<RecursiveMutex> lock;
+    publish_event_t* event {};
+    for (;; victim--) {
+        // One queue lock at a time, reprioritize() and publishBulk() take
+        // several in ascending order
+        if (lock.owns_lock()) {
+            lock.unlock();
+        }
+        lock = std::unique_lock<RecursiveMutex>(_queueLocks[victim]);
+        event = front(victim);
+        if (event != nullptr && (queue_full || event->event_data != nullptr)) {
+            break;
+        }
+        if (victim == priority) {
+            return false;
+        }
+    }
+
+    if (log_allowed(log_site::EVICTING)) {
+        logger.warn("evicting event from queue at priority %d", victim);
+    }
+    queue_entry_t entry;
+    _queues[victim].pop(entry);
+    _depth[victim]--;
+    event->state = publish_status::FAILED;
+    event->result = particle::Error::BUSY;
+    lock.unlock();
+
+    if (_dispatchMode != dispatch_mode::INLINE && event->event_data != nullptr) {
+        // The request evicting it may need the buffer now, not once the
+        // callback has been dispatched
+        if (!_freePayloads.push(event->event_data)) {
+            logger.error("event data buffer lost");
+        }
+        event->event_data = nullptr;
+    }
+    complete(*event, particle::Error::BUSY, event->event_data);
+
+    return true;
+}
+
+// Records the outcome of a dequeued event, wakes any future waiting on it,
+// then calls its callback and releases it. Returns FALSE if there was no
+// callback
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::complete(publish_event_t& event, particle::Error error, const char *data)
+{
+    count_outcome(event.priority, error);
+    Hooks::onComplete(event.event_name, event.priority, error);
+    record_trace(event, error);
+
+    std::unique_lock<RecursiveMutex> lock(_mutex);
+
+    if (error == particle::Error::NONE) {
+        event.state = publish_status::SENT;
+    } else if (error == particle::Error::CANCELLED) {
+        event.state = publish_status::CANCELLED;
+    } else {
+        event.state = publish_status::FAILED;
+    }
+    event.result = error;
+    signal(_completion);
+    if (_dispatchMode != dispatch_mode::INLINE && event.completed_cb != nullptr) {
+        // Released once dispatchCompletions() has called the callback
+        _completions.push(&event - _events.get());
+        os_semaphore_give(_dispatchReady, false);
+        return true;
+    }
+    // Taken under the lock since publish_future::onDone() can set it
+    auto cb {std::move(event.completed_cb)};
+    event.completed_cb = nullptr;
+    lock.unlock();
+
+    notify(cb, error, event.event_name, data ? data : "");
+    release(event);
+
+    return cb != nullptr;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+std::size_t BackgroundPublish<NumQueues, Hooks>::dispatchCompletions()
+{
+    std::size_t count {};
+    std::unique_lock<RecursiveMutex> lock(_mutex);
+
+    std::uint16_t index;
+    while (_completions.pop(index)) {
+        auto &event {_events[index]};
+        auto cb {std::move(event.completed_cb)};
+        event.completed_cb = nullptr;
+        lock.unlock();
+
+        notify(cb, event.result, event.event_name, event.event_data ? event.event_data : "");
+        release(event);
+        count++;
+        lock.lock();
+    }
+
+    return count;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::dispatcher()
+{
+    while (running) {
+        os_semaphore_take(_dispatchReady, CONCURRENT_WAIT_FOREVER, false);
+        dispatchCompletions();
+    }
+}
+
+// Returns a completed event and its data buffer to the pools. The final state
+// is kept for status() until the event is reused
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::release(publish_event_t& event)
+{
+    std::lock_guard<RecursiveMutex> lock(_mutex);
+
+    if (event.event_data != nullptr) {
+        if (!_freePayloads.push(event.event_data)) {
+            logger.error("event data buffer lost");
+        }
+        event.event_data = nullptr;
+    }
+    // Drop anything captured by the producer now rather than on reuse
+    event.producer = nullptr;
+    if (--event.refs == 0 && !_freeEvents.push(&event - _events.get())) {
+        logger.error("event %u lost", (unsigned)(&event - _events.get()));
+    }
+    signal(_space);
+}
+
+// Returns the event of handle and its state, or nullptr once the event has
+// been reused. Producers reuse events without the lock but bump the generation
+// first, so reading it again confirms state belongs to handle. An event that
+// is still QUEUED can't be reused while its queue lock is held
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_event_t* BackgroundPublish<NumQueues, Hooks>::lookup(const publish_handle& handle,
+                                                                                           publish_status& state)
+{
+    if (handle._owner != this || handle._index >= _eventCount) {
+        return nullptr;
+    }
+    auto &event {_events[handle._index]};
+    if (event.generation != handle._generation) {
+        return nullptr;
+    }
+    state = event.state;
+    if (event.generation != handle._generation) {
+        return nullptr;
+    }
+    return &event;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_handle BackgroundPublish<NumQueues, Hooks>::handle_of(const publish_event_t* event)
+{
+    return publish_handle(this, event - _events.get(), event->generation);
+}
+
+// Locks the queue event is in, checking again once the lock is held since
+// reprioritize() can move it meanwhile
+template<std::size_t NumQueues, typename Hooks>
+std::unique_lock<RecursiveMutex> BackgroundPublish<NumQueues, Hooks>::lock_queue(publish_event_t& event)
+{
+    while (true) {
+        std::size_t priority {event.priority};
+        std::unique_lock<RecursiveMutex> lock(_queueLocks[priority]);
+        if (event.priority == priority) {
+            return lock;
+        }
+    }
+}
+
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::cancel(const publish_handle& handle)
+{
+    publish_status state;
+    auto event {lookup(handle, state)};
+    if (event == nullptr || state != publish_status::QUEUED) {
+        return false;
+    }
+    auto lock {lock_queue(*event)};
+    // The worker may have taken it before the lock was held
+    if (lookup(handle, state) == nullptr || state != publish_status::QUEUED) {
+        return false;
+    }
+    // Leave the queue entry behind as stale rather than searching for it,
+    // front() drops it now if nothing live is ahead of it
+    event->ticket++;
+    event->state = publish_status::CANCELLED;
+    event->result = particle::Error::CANCELLED;
+    _depth[event->priority]--;
+    front(event->priority);
+    signal(_space);
+    lock.unlock();
+
+    complete(*event, particle::Error::CANCELLED, event->event_data);
+
+    return true;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_status BackgroundPublish<NumQueues, Hooks>::status(const publish_handle& handle)
+{
+    publish_status state;
+    return lookup(handle, state) != nullptr ? state : publish_status::UNKNOWN;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::reprioritize(const publish_handle& handle, std::size_t priority)
+{
+    publish_status state;
+    auto event {lookup(handle, state)};
+    if (event == nullptr || state != publish_status::QUEUED || priority >= NumQueues) {
+        return false;
+    }
+    // Hold both queues, in index order so two moves can't deadlock
+    std::size_t from {event->priority};
+    std::unique_lock<RecursiveMutex> first(_queueLocks[std::min(from, priority)]);
+    std::unique_lock<RecursiveMutex> second(_queueLocks[std::max(from, priority)]);
+    if (event->priority != from ||
+        lookup(handle, state) == nullptr ||
+        state != publish_status::QUEUED) {
+        return false;
+    }
+    if (from == priority) {
+        return true;
+    }
+    if (!claim(priority)) {
+        return false;
+    }
+    // The entry in the old queue becomes stale once the new one is in
+    if (!_queues[priority].push({event->ticket + 1, (std::uint16_t)(event - _events.get())})) {
+        unclaim(priority);
+        return false;
+    }
+    _occupied |= 1u << priority;
+    event->ticket++;
+    event->priority = priority;
+    _depth[from]--;
+    front(from);
+    signal(_space);
+
+    return true;
+}
+
+// Blocks until list is signalled or timeout expires. The caller has counted
+// itself in list.waiters before checking its condition
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::wait(wait_list_t& list, system_tick_t timeout)
+{
+    return os_semaphore_take(list.semaphore, timeout, false) == 0;
+}
+
+// Wakes every thread waiting on list so it can check its condition again.
+// A waiter that didn't need to sleep just wakes up early next time
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::signal(wait_list_t& list)
+{
+    for (auto i {list.waiters.load()}; i > 0; i--) {
+        os_semaphore_give(list.semaphore, false);
+    }
+}
+
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::future_done(std::uint16_t index, particle::Error* error)
+{
+    std::lock_guard<RecursiveMutex> lock(_mutex);
+
+    auto &event {_events[index]};
+    if (error != nullptr) {
+        *error = event.result;
+    }
+    return is_done(event.state);
+}
+
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::future_wait(std::uint16_t index, std::chrono::milliseconds timeout)
+{
+    auto start {millis()};
+    auto done {true};
+
+    _completion.waiters++;
+    while (!is_done(_events[index].state)) {
+        auto elapsed {millis() - start};
+        if (elapsed >= (system_tick_t)timeout.count() ||
+            !wait(_completion, timeout.count() - elapsed)) {
+            // The event may have completed right at the deadline
+            done = is_done(_events[index].state);
+            break;
+        }
+    }
+    _completion.waiters--;
+    return done;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::future_on_done(std::uint16_t index, const publish_callback& cb)
+{
+    std::unique_lock<RecursiveMutex> lock(_mutex);
+
+    auto &event {_events[index]};
+    if (!is_done(event.state)) {
+        event.completed_cb = cb;
+        return;
+    }
+    lock.unlock();
+    notify(cb, event.result, event.event_name, "");
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::future_release(std::uint16_t index)
+{
+    std::lock_guard<RecursiveMutex> lock(_mutex);
+
+    auto &event {_events[index]};
+    if (!is_done(event.state)) {
+        // Nobody to tell about the outcome anymore
+        event.completed_cb = nullptr;
+    }
+    if (--event.refs == 0) {
+        if (!_freeEvents.push(index)) {
+            logger.error("event %u lost", (unsigned)index);
+        }
+        signal(_space);
+    }
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::notify(const publish_callback& cb,
+                                          particle::Error error,
+                                          const char *name,
+                                          const char *data)
+{
+    if (cb != nullptr) {
+        cb(error, name, data);
+    }
+}
+
+// Returns FALSE if the message at site should be suppressed. Formatting a
+// log message costs more than the rest of a rejected publish, so a flood
+// must not log every request
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::log_allowed(log_site site)
+{
+    auto &limit {_logLimits[(std::size_t)site]};
+    roll_log(site, _clock());
+    if (limit.count.fetch_add(1, std::memory_order_relaxed) < log_burst) {
+        return true;
+    }
+    limit.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Opens a new window for site once the current one is over and sums up what
+// the old one suppressed
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::roll_log(log_site site, system_tick_t now)
+{
+    static const char* const names[] {
+        "truncated data",
+        "failed publish",
+        "not initialized",
+        "invalid priority",
+        "full queue",
+        "no data buffer",
+        "no event",
+        "eviction",
+        "rejected batch",
+    };
+    static_assert(sizeof(names) / sizeof(names[0]) == (std::size_t)log_site::COUNT, "a name for each log site");
+
+    auto &limit {_logLimits[(std::size_t)site]};
+    auto window {limit.window.load(std::memory_order_relaxed)};
+    if (now - window >= log_window &&
+        limit.window.compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+        limit.count.store(0, std::memory_order_relaxed);
+        auto suppressed {limit.suppressed.exchange(0, std::memory_order_relaxed)};
+        if (suppressed != 0) {
+            logger.warn("suppressed %lu %s messages", (unsigned long)suppressed, names[(std::size_t)site]);
+        }
+    }
+}
+
+// Logs the summaries of windows that are over, so a flood that stops still
+// gets one. Returns how long until the next summary is due
+template<std::size_t NumQueues, typename Hooks>
+system_tick_t BackgroundPublish<NumQueues, Hooks>::flush_logs()
+{
+    system_tick_t due {CONCURRENT_WAIT_FOREVER};
+    auto now {_clock()};
+    for (std::size_t site = 0; site < _logLimits.size(); site++) {
+        auto &limit {_logLimits[site]};
+        if (limit.suppressed.load(std::memory_order_relaxed) == 0) {
+            continue;
+        }
+        auto elapsed {now - limit.window.load(std::memory_order_relaxed)};
+        if (elapsed >= log_window) {
+            roll_log((log_site)site, now);
+        } else if (log_window - elapsed < due) {
+            due = log_window - elapsed;
+        }
+    }
+    return due;
+}
+
+// Calls back a request that was not accepted, counting it if there was no room,
+// either right away or by the end of a blocking publish's wait
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::reject(std::size_t priority,
+                                          const publish_callback& cb,
+                                          particle::Error error,
+                                          const char *name,
+                                          const char *data)
+{
+    if ((error == particle::Error::BUSY || error == particle::Error::TIMEOUT) && priority < NumQueues) {
+        _stats[priority].rejected.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (HAL_IsISR()) {
+        return; // the callback may allocate or lock, the caller sees the result
+    }
+    notify(cb, error, name, data);
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::count_outcome(std::size_t priority, particle::Error error)
+{
+    auto &stats {_stats[priority]};
+    auto &counter {error == particle::Error::NONE ? stats.sent :
+                   error == particle::Error::CANCELLED ? stats.cancelled :
+                   error == particle::Error::BUSY ? stats.evicted :
+                   error == particle::Error::LIMIT_EXCEEDED ? stats.limited :
+                   error == particle::Error::TIMEOUT ? stats.timedOut :
+                   stats.failed};
+    counter.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Adds a latency to the bucket of its highest set bit
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::record(latency_buckets_t& buckets, system_tick_t latency)
+{
+    std::size_t bucket {latency ? 32u - (std::size_t)__builtin_clz(latency) : 0u};
+    bucket = std::min(bucket, latency_buckets - 1);
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::latency_histogram BackgroundPublish<NumQueues, Hooks>::take(latency_buckets_t& buckets, bool reset)
+{
+    latency_histogram histogram;
+    for (std::size_t i = 0; i < latency_buckets; i++) {
+        histogram.counts[i] = reset ? buckets[i].exchange(0, std::memory_order_relaxed)
+                                    : buckets[i].load(std::memory_order_relaxed);
+    }
+    return histogram;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::record_trace(const publish_event_t& event, particle::Error error)
+{
+    if (_traceSize == 0) {
+        return;
+    }
+
+    std::uint32_t hash {2166136261u};
+    for (auto c = event.event_name; *c != '\0'; c++) {
+        hash = (hash ^ (std::uint8_t)*c) * 16777619u;
+    }
+
+    auto n {_traceNext.fetch_add(1, std::memory_order_relaxed)};
+    auto &slot {_trace[n % _traceSize]};
+    // A writer a lap ahead or behind may hold the slot, the record is
+    // dropped rather than mixed with that one
+    auto sequence {slot.sequence.load(std::memory_order_relaxed)};
+    if ((sequence & 1u) != 0 || (std::int32_t)(sequence - 2 * n) > 0 ||
+        !slot.sequence.compare_exchange_strong(sequence, 2 * n + 1, std::memory_order_relaxed)) {
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.nameHash.store(hash, std::memory_order_relaxed);
+    slot.priority.store(event.priority, std::memory_order_relaxed);
+    slot.enqueued.store(event.enqueued, std::memory_order_relaxed);
+    slot.sent.store(event.sent, std::memory_order_relaxed);
+    slot.completed.store(_clock(), std::memory_order_relaxed);
+    slot.result.store(error.type(), std::memory_order_relaxed);
+    slot.sequence.store(2 * n + 2, std::memory_order_release);
+}
+
+// Copies the nth record ever written, FALSE if it is still being written or
+// was already overwritten by a later one
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::read_trace(std::uint32_t n, trace_record& record) const
+{
+    auto &slot {_trace[n % _traceSize]};
+    auto sequence {slot.sequence.load(std::memory_order_acquire)};
+    record.nameHash = slot.nameHash.load(std::memory_order_relaxed);
+    record.priority = slot.priority.load(std::memory_order_relaxed);
+    record.enqueued = slot.enqueued.load(std::memory_order_relaxed);
+    record.sent = slot.sent.load(std::memory_order_relaxed);
+    record.completed = slot.completed.load(std::memory_order_relaxed);
+    record.result = slot.result.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return sequence == 2 * n + 2 && slot.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+std::size_t BackgroundPublish<NumQueues, Hooks>::trace(trace_record* records, std::size_t count) const
+{
+    auto end {_traceNext.load(std::memory_order_acquire)};
+    auto available {std::min<std::size_t>({end, _traceSize, count})};
+    std::size_t copied {};
+
+    for (auto n = end - (std::uint32_t)available; n != end; n++) {
+        if (read_trace(n, records[copied])) {
+            copied++;
+        }
+    }
+
+    return copied;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::dumpTrace() const
+{
+    trace_record record;
+    auto end {_traceNext.load(std::memory_order_acquire)};
+    auto available {std::min<std::size_t>(end, _traceSize)};
+
+    // One at a time, so no buffer for the whole ring is needed
+    for (auto n = end - (std::uint32_t)available; n != end; n++) {
+        if (!read_trace(n, record)) {
+            continue;
+        }
+        logger.info("%08lx p%u queued %lu sent %lu done %lu result %d",
+                    (unsigned long)record.nameHash,
+                    (unsigned)record.priority,
+                    (unsigned long)record.enqueued,
+                    (unsigned long)record.sent,
+                    (unsigned long)record.completed,
+                    record.result);
+    }
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_stats BackgroundPublish<NumQueues, Hooks>::stats(std::size_t priority, bool reset)
+{
+    publish_stats snapshot {};
+    if (priority >= NumQueues) {
+        return snapshot;
+    }
+
+    auto &counters {_stats[priority]};
+    auto read = [reset](std::atomic<std::uint32_t>& counter) {
+        return reset ? counter.exchange(0, std::memory_order_relaxed)
+                     : counter.load(std::memory_order_relaxed);
+    };
+    snapshot.depth = _depth[priority];
+    snapshot.highWater = reset ? counters.highWater.exchange(snapshot.depth, std::memory_order_relaxed)
+                               : counters.highWater.load(std::memory_order_relaxed);
+    snapshot.enqueued = read(counters.enqueued);
+    snapshot.sent = read(counters.sent);
+    snapshot.rejected = read(counters.rejected);
+    snapshot.cancelled = read(counters.cancelled);
+    snapshot.evicted = read(counters.evicted);
+    snapshot.limited = read(counters.limited);
+    snapshot.timedOut = read(counters.timedOut);
+    snapshot.failed = read(counters.failed);
+    snapshot.queueWait = take(counters.queueWait, reset);
+    snapshot.network = take(counters.network, reset);
+
+    return snapshot;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_handle BackgroundPublish<NumQueues, Hooks>::publish(const char *name,
+                                           const char *data,
+                                           PublishFlags flags,
+                                           std::size_t priority,
+                                           publish_callback cb,
+                                           std::chrono::milliseconds timeout)
+{
+    auto start {millis()};
+
+    publish_event_t* event {};
+    auto error {reserve(name, flags, priority, cb, true, event)};
+    if (error == particle::Error::BUSY && timeout.count() > 0) {
+        _space.waiters++;
+        while ((error = reserve(name, flags, priority, cb, true, event)) == particle::Error::BUSY) {
+            auto elapsed {millis() - start};
+            if (elapsed >= (system_tick_t)timeout.count() ||
+                !wait(_space, timeout.count() - elapsed)) {
+                error = particle::Error::TIMEOUT;
+                break;
+            }
+        }
+        _space.waiters--;
+    }
+    if (!error) {
+        copy_data(event->event_data, data);
+        // The event may be sent and reused as soon as it is enqueued
+        auto handle {handle_of(event)};
+        error = enqueue(*event);
+        if (!error) {
+            return handle;
+        }
+    }
+    reject(priority, cb, error, name, data);
+
+    return publish_handle();
+}
+
+template<std::size_t NumQueues, typename Hooks>
+std::size_t BackgroundPublish<NumQueues, Hooks>::publishBulk(publish_request_t* requests,
+                                                      std::size_t count,
+                                                      bulk_mode mode)
+{
+    std::size_t accepted {};
+    std::size_t reserved {}; // ALL_OR_NOTHING requests holding an event
+    std::size_t failed {count}; // request that failed an ALL_OR_NOTHING batch
+    std::size_t enqueued {}; // ALL_OR_NOTHING requests enqueued before it failed
+
+    if (HAL_IsISR()) {
+        // Nothing is reserved, so no locks are taken and nothing is logged
+        for (std::size_t i = 0; i < count; i++) {
+            requests[i].handle = publish_handle();
+            requests[i].result = particle::Error::INVALID_STATE;
+        }
+        return 0;
+    }
+
+    for (std::size_t i = 0; i < count; i++) {
+        auto &request {requests[i]};
+        publish_event_t* event {};
+        request.handle = publish_handle();
+        request.result = reserve(request.name,
+                                 request.flags,
+                                 request.priority,
+                                 request.cb,
+                                 true,
+                                 event,
+                                 mode == bulk_mode::BEST_EFFORT);
+        if (request.result) {
+            if (mode == bulk_mode::ALL_OR_NOTHING) {
+                if (log_allowed(log_site::BATCH)) {
+                    logger.error("batch doesn't fit in queue at priority %d", request.priority);
+                }
+                failed = i;
+                break;
+            }
+            continue;
+        }
+        copy_data(event->event_data, request.data);
+        request.handle = handle_of(event);
+        reserved++;
+        if (mode == bulk_mode::BEST_EFFORT) {
+            request.result = enqueue(*event);
+            if (request.result) {
+                request.handle = publish_handle();
+            } else {
+                accepted++;
+            }
+        }
+    }
+
+    if (mode == bulk_mode::ALL_OR_NOTHING) {
+        // Nothing has been enqueued yet. The locks keep the worker from
+        // sending part of the batch while it can still be taken back
+        std::array<std::unique_lock<RecursiveMutex>, NumQueues> locks;
+        for (std::size_t priority = 0; priority < NumQueues; priority++) {
+            locks[priority] = std::unique_lock<RecursiveMutex>(_queueLocks[priority]);
+        }
+        for (std::size_t i = 0; i < count && failed == count; i++) {
+            if (enqueue(_events[requests[i].handle._index])) {
+                requests[i].result = particle::Error::BUSY;
+                requests[i].handle = publish_handle();
+                failed = i;
+            } else {
+                enqueued++;
+            }
+        }
+        for (std::size_t i = 0; i < count; i++) {
+            auto &request {requests[i]};
+            if (failed == count) {
+                accepted++;
+            } else if (i != failed) {
+                if (i < enqueued) {
+                    // Already counted as enqueued, only reserved otherwise
+                    _stats[request.priority].cancelled.fetch_add(1, std::memory_order_relaxed);
+                }
+                if (i < reserved) {
+                    unreserve(_events[request.handle._index]);
+                }
+                request.handle = publish_handle();
+                request.result = particle::Error::CANCELLED;
+            }
+        }
+    }
+
+    for (std::size_t i = 0; i < count; i++) {
+        if (requests[i].result) {
+            reject(requests[i].priority, requests[i].cb, requests[i].result, requests[i].name, requests[i].data);
+        }
+    }
+
+    return accepted;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_future BackgroundPublish<NumQueues, Hooks>::publishAsync(const char *name,
+                                                                                             const char *data,
+                                                                                             PublishFlags flags,
+                                                                                             std::size_t priority)
+{
+    publish_event_t* event {};
+    auto error {reserve(name, flags, priority, nullptr, true, event)};
+    if (!error) {
+        copy_data(event->event_data, data);
+        event->refs++;
+        error = enqueue(*event);
+    }
+    if (error) {
+        reject(priority, nullptr, error, name, data);
+        return publish_future(error);
+    }
+
+    return publish_future(this, event - _events.get());
+}
+
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::waitAll(const publish_future* futures,
+                                           std::size_t count,
+                                           std::chrono::milliseconds timeout)
+{
+    auto start {millis()};
+
+    for (std::size_t i = 0; i < count; i++) {
+        auto elapsed {std::chrono::milliseconds(millis() - start)};
+        if (!futures[i].wait(std::max(timeout - elapsed, std::chrono::milliseconds::zero()))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+typename BackgroundPublish<NumQueues, Hooks>::publish_handle BackgroundPublish<NumQueues, Hooks>::publishDeferred(const char *name,
+                                                   payload_producer producer,
+                                                   PublishFlags flags,
+                                                   std::size_t priority,
+                                                   publish_callback cb)
+{
+    publish_event_t* event {};
+    auto error {producer != nullptr ? particle::Error(particle::Error::NONE)
+                                    : particle::Error(particle::Error::INVALID_ARGUMENT)};
+    if (!error) {
+        error = reserve(name, flags, priority, cb, false, event);
+    }
+    if (!error) {
+        event->producer = producer;
+        auto handle {handle_of(event)};
+        error = enqueue(*event);
+        if (!error) {
+            return handle;
+        }
+    }
+    reject(priority, cb, error, name, "");
+
+    return publish_handle();
+}
+
+template<std::size_t NumQueues, typename Hooks>
+bool BackgroundPublish<NumQueues, Hooks>::publishFromISR(const char *name,
+                                                  const char *data,
+                                                  PublishFlags flags,
+                                                  std::size_t priority,
+                                                  isr_callback cb)
+{
+    std::uint16_t index;
+    if (!running) {
+        return false;
+    }
+    if (!_freeIsr.pop(index)) {
+        _isrDropped++;
+        return false;
+    }
+    auto &entry {_isrEntries[index]};
+    entry.flags = flags;
+    entry.priority = priority;
+    entry.cb = cb;
+    std::strncpy(entry.name, name, sizeof(entry.name));
+    entry.name[sizeof(entry.name) - 1] = '\0';
+    copy_data(entry.data, data);
+    // Can't fail, there are as many pending places as entries
+    _pendingIsr.push(index);
+    // os_semaphore_give() is interrupt safe, it yields to the woken thread
+    wake();
+
+    return true;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+int BackgroundPublish<NumQueues, Hooks>::publishf(const char *name,
+                                           std::size_t priority,
+                                           const char *fmt,
+                                           ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    auto ret {vpublishf(name, PRIVATE, priority, nullptr, fmt, args)};
+    va_end(args);
+    return ret;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+int BackgroundPublish<NumQueues, Hooks>::vpublishf(const char *name,
+                                            PublishFlags flags,
+                                            std::size_t priority,
+                                            publish_callback cb,
+                                            const char *fmt,
+                                            va_list args)
+{
+    publish_event_t* event {};
+    auto error {reserve(name, flags, priority, cb, true, event)};
+    if (error) {
+        reject(priority, cb, error, name, nullptr);
+        return error.type();
+    }
+    // Format in place, an encoding error leaves the event with empty data
+    auto len {std::vsnprintf(event->event_data, sizeof(payload_t::data), fmt, args)};
+    if (len < 0) {
+        event->event_data[0] = '\0';
+        len = 0;
+    }
+    if ((std::size_t)len > particle::protocol::MAX_EVENT_DATA_LENGTH) {
+        if (log_allowed(log_site::TRUNCATED)) {
+            logger.warn("event data truncated from %d bytes", len);
+        }
+    }
+    error = enqueue(*event);
+    if (error) {
+        reject(priority, cb, error, name, nullptr);
+        return error.type();
+    }
+
+    return len;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+template<typename Fill>
+int BackgroundPublish<NumQueues, Hooks>::publishJson(const char *name,
+                                              Fill fill,
+                                              PublishFlags flags,
+                                              std::size_t priority,
+                                              publish_callback cb)
+{
+    publish_event_t* event {};
+    auto error {reserve(name, flags, priority, cb, true, event)};
+    if (error) {
+        reject(priority, cb, error, name, nullptr);
+        return error.type();
+    }
+    // Leave room for the null terminator, JSONBufferWriter doesn't add one
+    JSONBufferWriter writer(event->event_data, sizeof(payload_t::data) - 1);
+    fill(static_cast<JSONWriter&>(writer));
+    auto len {writer.dataSize()};
+    event->event_data[std::min(len, writer.bufferSize())] = '\0';
+    if (len > writer.bufferSize()) {
+        if (log_allowed(log_site::TRUNCATED)) {
+            logger.warn("event data truncated from %d bytes", len);
+        }
+    }
+    error = enqueue(*event);
+    if (error) {
+        reject(priority, cb, error, name, nullptr);
+        return error.type();
+    }
+
+    return (int)len;
+}
+
+template<std::size_t NumQueues, typename Hooks>
+void BackgroundPublish<NumQueues, Hooks>::cleanup()
+{
+    // Detach everything queued so far by marking the end of each queue. The
+    // worker and eviction leave the entries ahead of the mark to cleanup()
+    std::array<std::size_t, NumQueues> previous;
+    std::array<std::size_t, NumQueues> detached;
+    for(std::size_t priority = 0; priority < NumQueues; priority++) {
+        std::lock_guard<RecursiveMutex> lock(_queueLocks[priority]);
+        previous[priority] = _detached[priority];
+        detached[priority] = _detached[priority] = _queues[priority].pushed();
+        _detaching[priority]++;
+    }
 
-    for(auto &queue : _queues) {
-        while(!queue.empty()) {
-            publish_event_t &event {queue.front()};
-            if(event.completed_cb != nullptr) {
-                event.completed_cb(particle::Error::CANCELLED,
-                            event.event_name,
-                            event.event_data);
+    for(std::size_t priority = 0; priority < NumQueues; priority++) {
+        std::unique_lock<RecursiveMutex> lock(_queueLocks[priority]);
+        queue_entry_t entry;
+        while((std::ptrdiff_t)(_queues[priority].popped() - detached[priority]) < 0 && _queues[priority].front(entry)) {
+            _queues[priority].pop(entry);
+            auto &event {_events[entry.index]};
+            if(event.ticket != entry.ticket || event.state != publish_status::QUEUED) {
+                continue;
             }
-            queue.pop();
+            event.ticket++;
+            event.state = publish_status::CANCELLED;
+            event.result = particle::Error::CANCELLED;
+            _depth[priority]--;
+            signal(_space);
+            // Callbacks may publish, so run them without holding the lock
+            lock.unlock();
+            complete(event, particle::Error::CANCELLED, event.event_data);
+            lock.lock();
         }
+        _detached[priority] = previous[priority];
+        _detaching[priority]--;
     }
 }
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2022 Particle Industries, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#include "Particle.h"
+
+/**
+ * @brief Fixed capacity FIFO used for the publish queues and free lists
+ *
+ * @details Bounded multi-producer ring where each cell carries a sequence
+ * number that tells producers and consumers whose turn it is, so push() and
+ * pop() never lock. Storage is allocated once on construction, rounded up to
+ * a power of two so positions map to the same cell across the wrap of the
+ * position counters. push() fails
+ * only when the ring is full. A pop that has claimed the cell push() needs
+ * but not yet released it is waited for, which can't happen when a single
+ * consumer pops and the ring holds fewer values than its capacity, so
+ * interrupts push without waiting then. front() is only reliable when a
+ * single consumer pops at a time, the publish queues serialize their
+ * consumers with a lock
+ */
+template<typename T>
+class PublishRing {
+public:
+    // start sets the initial position, tests use it to begin near the wrap
+    explicit PublishRing(std::size_t capacity = 0u, std::size_t start = 0u) :
+        _cells(capacity ? new cell_t[round_up(capacity)] : nullptr),
+        _capacity {capacity ? round_up(capacity) : 0u},
+        _head {start},
+        _tail {start}
+    {
+        for (std::size_t i = 0; i < _capacity; i++) {
+            _cells[(start + i) & (_capacity - 1)].sequence.store(start + i, std::memory_order_relaxed);
+        }
+    }
+
+    // Only for setting up a ring before it is shared
+    PublishRing& operator=(PublishRing&& other)
+    {
+        _cells = std::move(other._cells);
+        _capacity = other._capacity;
+        _head.store(other._head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        _tail.store(other._tail.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other._capacity = 0;
+        return *this;
+    }
+
+    bool push(const T& value)
+    {
+        auto pos {_tail.load(std::memory_order_relaxed)};
+        while (_capacity) {
+            auto &cell {_cells[pos & (_capacity - 1)]};
+            auto diff {(std::ptrdiff_t)(cell.sequence.load(std::memory_order_acquire) - pos)};
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // A lap behind, full unless a pop still holds the cell
+                auto head {_head.load(std::memory_order_acquire)};
+                if ((std::ptrdiff_t)(pos - head) >= (std::ptrdiff_t)_capacity) {
+                    return false;
+                }
+                os_thread_yield();
+                pos = _tail.load(std::memory_order_relaxed);
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+        return false;
+    }
+
+    bool pop(T& value)
+    {
+        auto pos {_head.load(std::memory_order_relaxed)};
+        while (_capacity) {
+            auto &cell {_cells[pos & (_capacity - 1)]};
+            auto diff {(std::ptrdiff_t)(cell.sequence.load(std::memory_order_acquire) - (pos + 1))};
+            if (diff == 0) {
+                if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + _capacity, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // nothing published yet, empty
+            } else {
+                pos = _head.load(std::memory_order_relaxed);
+            }
+        }
+        return false;
+    }
+
+    bool front(T& value) const
+    {
+        auto pos {_head.load(std::memory_order_relaxed)};
+        if (!_capacity) {
+            return false;
+        }
+        auto &cell {_cells[pos & (_capacity - 1)]};
+        if (cell.sequence.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+        value = cell.value;
+        return true;
+    }
+
+    // Counts are a snapshot while other threads push and pop
+    std::size_t pushed() const { return _tail.load(std::memory_order_acquire); }
+    std::size_t popped() const { return _head.load(std::memory_order_acquire); }
+    std::size_t size() const
+    {
+        auto head {popped()}; // read first, the tail never falls behind it
+        return pushed() - head;
+    }
+    std::size_t capacity() const { return _capacity; } // at least as asked for
+    bool empty() const { return size() == 0; }
+    bool full() const { return size() >= _capacity; }
+
+private:
+    static std::size_t round_up(std::size_t capacity)
+    {
+        std::size_t rounded {1u};
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        return rounded;
+    }
+
+    struct cell_t {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<cell_t[]> _cells;
+    std::size_t _capacity;
+    std::atomic<std::size_t> _head; // total pops, wraps with the counter type
+    std::atomic<std::size_t> _tail; // total pushes
+};
@@ -11,3 +11,6 @@
 SystemClass System;
 Logger Log;
 CloudClass Particle;
+bool isr_context = false;
+std::atomic<int> log_count {0};
+std::atomic<int> thread_priority {-1};
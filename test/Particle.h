@@ -1,8 +1,17 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <thread>
 #include "concurrent_hal.h"
 
 // List of all defined system errors
@@ -38,7 +47,6 @@
 #define SYSTEM_ERROR_AT_NOT_OK              (-1200)
 #define SYSTEM_ERROR_AT_RESPONSE_UNEXPECTED (-1210)
 
-typedef uint32_t system_tick_t;
 typedef uint16_t pin_t;
 
 namespace particle {
@@ -54,6 +62,7 @@ typedef void* os_mutex_recursive_t;
 class RecursiveMutex
 {
     os_mutex_recursive_t handle_;
+    std::recursive_mutex mutex_;
 public:
     /**
      * Creates a shared mutex.
@@ -72,10 +81,10 @@ public:
     {
     }
 
-    void lock() { }
-    bool trylock() { return true; }
-    bool try_lock() { return true; }
-    void unlock() {}
+    void lock() { mutex_.lock(); }
+    bool trylock() { return mutex_.try_lock(); }
+    bool try_lock() { return mutex_.try_lock(); }
+    void unlock() { mutex_.unlock(); }
 
 };
 
@@ -95,6 +104,11 @@ public:
     }
 
     uint64_t millis() const {
+        if (_realTime) {
+            // Keeps counting from where the manual ticks left off
+            return _tick + std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - _realStart).count();
+        }
         return _tick;
     }
 
@@ -102,28 +116,45 @@ public:
         _tick += i;
     }
 
+    // Lets millis() advance with the host clock, for tests with real threads
+    void realTime(bool enable) {
+        if (!enable && _realTime) {
+            _tick = millis();
+        }
+        _realStart = std::chrono::steady_clock::now();
+        _realTime = enable;
+    }
+
 private:
-    uint64_t _tick;
+    std::atomic<uint64_t> _tick; // read by the publisher from other threads
+    std::atomic<bool> _realTime {false};
+    std::chrono::steady_clock::time_point _realStart;
 };
 
+extern std::atomic<int> log_count; // messages logged at warn level and above
+
 class Logger {
 public:
     Logger() = default;
     Logger(const char *) {};
     void trace(const char* str, ...) {};
     void info(const char* str, ...) {};
-    void error(const char* str, ...) {};
-    void warn(const char* str, ...) {};
+    void error(const char* str, ...) { log_count++; };
+    void warn(const char* str, ...) { log_count++; };
 };
 
 extern SystemClass System;
 extern Logger Log;
 
 inline system_tick_t millis(void) { return System.millis(); }
+inline unsigned long micros(void) { return System.millis() * 1000; }
+
+extern bool isr_context; // set by tests to run code as if in an interrupt
+extern std::atomic<int> thread_priority; // of the most recently created Thread
 
 static inline bool HAL_IsISR() 
 {
-	return false;
+	return isr_context;
 }
 
 static void vPortYield( void )
@@ -177,13 +208,14 @@ class Error {
 public:
     // Error type
     enum Type {
-        NONE = 0,
-        UNKNOWN,
-        INVALID_STATE,
-        INVALID_ARGUMENT,
-        BUSY,
-        LIMIT_EXCEEDED,
-        CANCELLED,
+        NONE = SYSTEM_ERROR_NONE,
+        UNKNOWN = SYSTEM_ERROR_UNKNOWN,
+        INVALID_STATE = SYSTEM_ERROR_INVALID_STATE,
+        INVALID_ARGUMENT = SYSTEM_ERROR_INVALID_ARGUMENT,
+        BUSY = SYSTEM_ERROR_BUSY,
+        LIMIT_EXCEEDED = SYSTEM_ERROR_LIMIT_EXCEEDED,
+        CANCELLED = SYSTEM_ERROR_CANCELLED,
+        TIMEOUT = SYSTEM_ERROR_TIMEOUT,
     };
 
     Error(Type type = UNKNOWN);
@@ -201,6 +233,8 @@ public:
 
     explicit operator bool() const;
 
+    Error& operator=(Error error);
+
 private:
     const char* msg_;
     Type type_;
@@ -254,25 +288,69 @@ inline Error::operator bool() const {
     return type_ != NONE;
 }
 
+inline void swap(Error& error1, Error& error2) {
+    std::swap(error1.msg_, error2.msg_);
+    std::swap(error1.type_, error2.type_);
+}
+
+inline Error& Error::operator=(Error error) {
+    swap(*this, error);
+    return *this;
+}
+
+// A publish answered by the simulated cloud once readyAt has passed
+struct SimulatedPublish {
+    std::chrono::steady_clock::time_point readyAt;
+    Error::Type result;
+    std::atomic<bool> cancelled {false};
+
+    bool isDone() const {
+        return cancelled || std::chrono::steady_clock::now() >= readyAt;
+    }
+};
+
 template<typename ContextT>
 class Future {
 public:
     Future() {}
+    // Reads through to the source, like the state shared by real futures
+    explicit Future(const Future* source) : source(source) {}
+    explicit Future(std::shared_ptr<SimulatedPublish> simulated) : simulated(simulated) {}
+
     bool isSucceeded() const {
-        return isSucceededReturn;
+        if (simulated) {
+            return isDone() && error() == Error::NONE;
+        }
+        return source ? source->isSucceeded() : isSucceededReturn;
     }
 
     bool isDone() const {
-        return isDoneReturn;
+        if (simulated) {
+            return simulated->isDone();
+        }
+        return source ? source->isDone() : isDoneReturn;
     }
 
     Error error() const {
-        return err;
+        if (simulated) {
+            return simulated->cancelled ? Error::CANCELLED :
+                   simulated->isDone() ? simulated->result : Error::NONE;
+        }
+        return source ? source->error() : err;
+    }
+
+    bool cancel() {
+        if (simulated) {
+            return !simulated->isDone() && !simulated->cancelled.exchange(true);
+        }
+        return true;
     }
 
     bool isDoneReturn;
     bool isSucceededReturn;
     Error err;
+    const Future* source {nullptr};
+    std::shared_ptr<SimulatedPublish> simulated;
 };
 
 namespace protocol {
@@ -282,6 +360,79 @@ namespace protocol {
 
 } // namespace particle
 
+class JSONWriter {
+public:
+    virtual ~JSONWriter() = default;
+
+    JSONWriter& beginArray() { delimit(); write("[", 1); first_ = true; return *this; }
+    JSONWriter& endArray() { write("]", 1); first_ = false; return *this; }
+    JSONWriter& beginObject() { delimit(); write("{", 1); first_ = true; return *this; }
+    JSONWriter& endObject() { write("}", 1); first_ = false; return *this; }
+    JSONWriter& name(const char* name) {
+        delimit();
+        writeString(name);
+        write(":", 1);
+        first_ = true;
+        return *this;
+    }
+    JSONWriter& value(bool val) { delimit(); val ? write("true", 4) : write("false", 5); return *this; }
+    JSONWriter& value(int val) { return printf("%d", val); }
+    JSONWriter& value(unsigned val) { return printf("%u", val); }
+    JSONWriter& value(double val) { return printf("%g", val); }
+    JSONWriter& value(const char* val) { delimit(); writeString(val); return *this; }
+    JSONWriter& nullValue() { delimit(); write("null", 4); return *this; }
+
+protected:
+    virtual void write(const char* data, size_t size) = 0;
+
+private:
+    bool first_ = true;
+
+    void delimit() {
+        if (!first_) {
+            write(",", 1);
+        }
+        first_ = false;
+    }
+    void writeString(const char* str) {
+        write("\"", 1);
+        write(str, strlen(str));
+        write("\"", 1);
+    }
+    JSONWriter& printf(const char* fmt, ...) {
+        char buf[32];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        delimit();
+        write(buf, n);
+        return *this;
+    }
+};
+
+class JSONBufferWriter: public JSONWriter {
+public:
+    JSONBufferWriter(char* buf, size_t size) : buf_(buf), bufSize_(size), n_(0) {}
+
+    char* buffer() const { return buf_; }
+    size_t bufferSize() const { return bufSize_; }
+    size_t dataSize() const { return n_; }
+
+protected:
+    void write(const char* data, size_t size) override {
+        if (n_ < bufSize_) {
+            memcpy(buf_ + n_, data, std::min(size, bufSize_ - n_));
+        }
+        n_ += size;
+    }
+
+private:
+    char* buf_;
+    size_t bufSize_;
+    size_t n_;
+};
+
 struct PublishFlagType; // Tag type for Particle.publish() flags
 typedef particle::Flags<PublishFlagType, uint8_t> PublishFlags;
 typedef PublishFlags::FlagType PublishFlag;
@@ -289,14 +440,74 @@ typedef PublishFlags::FlagType PublishFlag;
 class CloudClass {
 public:
 
+    // How the simulated cloud answers, see simulate()
+    struct Simulation {
+        std::chrono::milliseconds latency {0}; // until a publish is acknowledged
+        double loss {0.0}; // share of publishes never acknowledged
+        std::chrono::milliseconds timeout {20000}; // until a lost publish fails with TIMEOUT
+        unsigned rateLimit {0}; // publishes accepted per second, LIMIT_EXCEEDED beyond, 0 for no limit
+        unsigned seed {1}; // of the losses
+    };
+
     CloudClass() {}
     inline particle::Future<bool> publish(const char *eventName, 
                                         const char *eventData, 
                                         PublishFlags flags1, 
                                         PublishFlags flags2 = PublishFlags()) {
-        return state_output;
+        std::lock_guard<std::mutex> lock(simMutex);
+        if (!simulating) {
+            return particle::Future<bool>(&state_output);
+        }
+
+        auto now {std::chrono::steady_clock::now()};
+        auto answer {std::make_shared<particle::SimulatedPublish>()};
+        while (!recent.empty() && now - recent.front() >= std::chrono::seconds(1)) {
+            recent.pop_front();
+        }
+        if (sim.rateLimit && recent.size() >= sim.rateLimit) {
+            answer->result = particle::Error::LIMIT_EXCEEDED;
+            answer->readyAt = now + sim.latency;
+            limited++;
+        } else if (std::uniform_real_distribution<double>(0.0, 1.0)(random) < sim.loss) {
+            recent.push_back(now);
+            answer->result = particle::Error::TIMEOUT;
+            answer->readyAt = now + sim.timeout;
+            lost++;
+        } else {
+            recent.push_back(now);
+            answer->result = particle::Error::NONE;
+            answer->readyAt = now + sim.latency;
+            acknowledged++;
+        }
+        return particle::Future<bool>(answer);
     }
+
+    // Answers publishes asynchronously instead of with state_output
+    void simulate(const Simulation& simulation) {
+        std::lock_guard<std::mutex> lock(simMutex);
+        sim = simulation;
+        random.seed(sim.seed);
+        recent.clear();
+        acknowledged = lost = limited = 0;
+        simulating = true;
+    }
+
+    void stopSimulation() {
+        std::lock_guard<std::mutex> lock(simMutex);
+        simulating = false;
+    }
+
     particle::Future<bool> state_output;
+    std::atomic<unsigned> acknowledged {0}; // by the simulated cloud
+    std::atomic<unsigned> lost {0};
+    std::atomic<unsigned> limited {0};
+
+private:
+    std::mutex simMutex;
+    bool simulating {false};
+    Simulation sim;
+    std::mt19937 random;
+    std::deque<std::chrono::steady_clock::time_point> recent; // accepted publishes in the last second
 };
 extern CloudClass Particle;
 
@@ -324,6 +535,8 @@ const PublishFlag WITH_ACK(PUBLISH_EVENT_FLAG_WITH_ACK);
 #define OS_THREAD_STACK_SIZE_DEFAULT_HIGH (4*1024)
 #define OS_THREAD_STACK_SIZE_DEFAULT_NETWORK (6*1024)
 
+// Runs the function on a host thread, priority and stack size are ignored
+// apart from recording the priority
 class Thread
 {
 public:
@@ -332,9 +545,31 @@ public:
     Thread(const char *name, 
             wiring_thread_fn_t function,
             os_thread_prio_t priority=OS_THREAD_PRIORITY_DEFAULT, 
-            size_t stack_size=OS_THREAD_STACK_SIZE_DEFAULT) {
+            size_t stack_size=OS_THREAD_STACK_SIZE_DEFAULT) :
+        thread_(function) {
+        thread_priority = priority;
+    }
+
+    Thread(Thread&&) = default;
+
+    Thread& operator=(Thread&& other) {
+        join();
+        thread_ = std::move(other.thread_);
+        return *this;
+    }
+
+    ~Thread() {
+        join();
     }
 
-    bool join() { return true; }
+    bool join() {
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        return true;
+    }
+
+private:
+    std::thread thread_;
 };
 
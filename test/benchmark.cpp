@@ -0,0 +1,239 @@
+/*
+ * Host benchmarks of the publish path, run against the mock platform. Each
+ * result is printed as one JSON object per line for regression tracking.
+ *
+ * Usage: background-publish-benchmark [--quick]
+ */
+
+#include "BackgroundPublish.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using host_clock = std::chrono::steady_clock;
+
+bool quick {false};
+
+// Every read by the same thread is a second later, so the rate limit never
+// holds the publisher back. Per thread, so producers don't share a counter
+system_tick_t unthrottled_clock()
+{
+    static thread_local system_tick_t now {};
+    return now += 1000u;
+}
+
+double ns_since(host_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(host_clock::now() - start).count();
+}
+
+template<std::size_t NumQueues>
+void start_cooperative(BackgroundPublish<NumQueues>& publisher)
+{
+    publisher.setRunMode(BackgroundPublish<NumQueues>::run_mode::COOPERATIVE);
+    publisher.setClock(unthrottled_clock);
+    publisher.start();
+}
+
+// Cost of an accepted publish(). Each batch fills the queues, cleanup()
+// empties them outside of the timed part
+template<std::size_t NumQueues>
+void bench_publish(std::size_t payload)
+{
+    constexpr std::size_t entries {16u};
+    BackgroundPublish<NumQueues> publisher(entries);
+    start_cooperative(publisher);
+
+    std::string data(payload, 'x');
+    std::size_t iterations {quick ? 20000u : 400000u};
+    std::size_t ops {};
+    double elapsed {};
+    while (ops < iterations) {
+        auto start {host_clock::now()};
+        for (std::size_t i = 0; i < entries * NumQueues; i++) {
+            publisher.publish("bench", data.c_str(), PRIVATE, i % NumQueues);
+        }
+        elapsed += ns_since(start);
+        ops += entries * NumQueues;
+        publisher.cleanup();
+    }
+    publisher.stop();
+
+    std::printf("{\"benchmark\":\"publish\",\"queues\":%zu,\"payload\":%zu,\"ops\":%zu,\"ns_per_op\":%.1f}\n",
+                NumQueues, payload, ops, elapsed / ops);
+}
+
+// Cost of a rejected publish() against full queues
+template<std::size_t NumQueues>
+void bench_reject()
+{
+    constexpr std::size_t entries {4u};
+    BackgroundPublish<NumQueues> publisher(entries);
+    start_cooperative(publisher);
+
+    for (std::size_t i = 0; i < entries * NumQueues; i++) {
+        publisher.publish("bench", "x", PRIVATE, i % NumQueues);
+    }
+    std::size_t ops {quick ? 20000u : 400000u};
+    auto start {host_clock::now()};
+    for (std::size_t i = 0; i < ops; i++) {
+        publisher.publish("bench", "x", PRIVATE, i % NumQueues);
+    }
+    auto elapsed {ns_since(start)};
+    publisher.stop();
+
+    std::printf("{\"benchmark\":\"reject\",\"queues\":%zu,\"ops\":%zu,\"ns_per_op\":%.1f}\n",
+                NumQueues, ops, elapsed / ops);
+}
+
+// Cost of the publisher taking an event, sending it to the mock cloud and
+// completing it
+template<std::size_t NumQueues>
+void bench_dequeue()
+{
+    constexpr std::size_t entries {16u};
+    BackgroundPublish<NumQueues> publisher(entries);
+    start_cooperative(publisher);
+
+    std::size_t iterations {quick ? 20000u : 400000u};
+    std::size_t ops {};
+    double elapsed {};
+    while (ops < iterations) {
+        for (std::size_t i = 0; i < entries * NumQueues; i++) {
+            publisher.publish("bench", "x", PRIVATE, i % NumQueues);
+        }
+        auto start {host_clock::now()};
+        while (publisher.process()) {
+            ops++;
+        }
+        ops++;
+        elapsed += ns_since(start);
+    }
+    publisher.stop();
+
+    std::printf("{\"benchmark\":\"dequeue\",\"queues\":%zu,\"ops\":%zu,\"ns_per_op\":%.1f}\n",
+                NumQueues, ops, elapsed / ops);
+}
+
+// Producers on several threads race each other and a consumer thread. A
+// producer retries a rejected publish until it is accepted, so the rate is
+// of events through the queues and busy counts the retries
+void bench_contention(int producers)
+{
+    BackgroundPublish<2> publisher(64);
+    start_cooperative(publisher);
+
+    std::size_t per_producer {quick ? 1000u : 50000u};
+    std::atomic<int> producing {producers};
+    std::atomic<std::size_t> busy {0};
+    std::thread consumer([&]() {
+        while (producing > 0 || publisher.process()) {
+            publisher.process();
+        }
+    });
+
+    auto start {host_clock::now()};
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&, p]() {
+            std::size_t retries {};
+            for (std::size_t i = 0; i < per_producer; i++) {
+                while (!publisher.publish("bench", "x", PRIVATE, (i + p) % 2)) {
+                    retries++;
+                    std::this_thread::yield();
+                }
+            }
+            busy += retries;
+            producing--;
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    consumer.join();
+    auto elapsed {ns_since(start)};
+    publisher.stop();
+
+    auto ops {per_producer * producers};
+    std::printf("{\"benchmark\":\"contention\",\"producers\":%d,\"ops\":%zu,\"busy\":%zu,"
+                "\"ns_per_op\":%.1f,\"ops_per_s\":%.0f}\n",
+                producers, ops, busy.load(), elapsed / ops, ops * 1e9 / elapsed);
+}
+
+// The publisher thread against the simulated cloud. Unthrottled leaves out
+// the rate limit, otherwise the publisher runs on the host clock and sends at
+// most 2 events per second
+void bench_end_to_end(std::chrono::milliseconds latency, bool throttled)
+{
+    CloudClass::Simulation cloud;
+    cloud.latency = latency;
+    Particle.simulate(cloud);
+    System.realTime(true);
+
+    BackgroundPublish<2> publisher(16);
+    if (!throttled) {
+        publisher.setClock(unthrottled_clock);
+    }
+    publisher.start();
+
+    auto duration {quick ? std::chrono::milliseconds(250) : std::chrono::milliseconds(3000)};
+    auto start {host_clock::now()};
+    std::size_t accepted {};
+    while (host_clock::now() - start < duration) {
+        if (publisher.publish("bench", "x", PRIVATE, accepted % 2)) {
+            accepted++;
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    auto elapsed {ns_since(start)};
+    publisher.stop();
+    System.realTime(false);
+    Particle.stopSimulation();
+
+    auto sent {publisher.stats(0).sent + publisher.stats(1).sent};
+    std::printf("{\"benchmark\":\"end_to_end\",\"latency_ms\":%lld,\"throttled\":%s,\"accepted\":%zu,"
+                "\"sent\":%lu,\"acknowledged\":%lu,\"events_per_s\":%.1f}\n",
+                (long long)latency.count(), throttled ? "true" : "false", accepted, (unsigned long)sent,
+                (unsigned long)Particle.acknowledged.load(), sent * 1e9 / elapsed);
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        }
+    }
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    for (std::size_t payload : {0u, 64u, 256u, (unsigned)particle::protocol::MAX_EVENT_DATA_LENGTH}) {
+        bench_publish<1>(payload);
+        bench_publish<4>(payload);
+        bench_publish<32>(payload);
+    }
+    bench_reject<1>();
+    bench_reject<32>();
+    bench_dequeue<1>();
+    bench_dequeue<4>();
+    bench_dequeue<32>();
+    for (int producers : {1, 2, 4, 8}) {
+        bench_contention(producers);
+    }
+    bench_end_to_end(std::chrono::milliseconds(0), false);
+    bench_end_to_end(std::chrono::milliseconds(20), false);
+    if (!quick) {
+        bench_end_to_end(std::chrono::milliseconds(20), true);
+    }
+
+    return 0;
+}
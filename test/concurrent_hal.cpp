@@ -1,4 +1,8 @@
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <mutex>
+#include <thread>
 
 #include "concurrent_hal.h"
 
@@ -6,3 +10,59 @@ os_result_t os_thread_exit(os_thread_t thread)
 {
 	return 0;
 }
+
+os_result_t os_thread_yield(void)
+{
+	std::this_thread::yield();
+	return 0;
+}
+
+namespace {
+
+// Counting semaphore on top of the host threading primitives
+struct semaphore {
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned count;
+    unsigned max;
+};
+
+} // namespace
+
+int os_semaphore_create(os_semaphore_t* sem, unsigned max, unsigned initial)
+{
+	*sem = new semaphore {{}, {}, initial, max};
+	return 0;
+}
+
+int os_semaphore_destroy(os_semaphore_t sem)
+{
+	delete static_cast<semaphore*>(sem);
+	return 0;
+}
+
+int os_semaphore_take(os_semaphore_t sem, system_tick_t timeout, bool reserved)
+{
+	auto s = static_cast<semaphore*>(sem);
+	std::unique_lock<std::mutex> lock(s->mutex);
+	auto available = [s] { return s->count > 0; };
+	if (timeout == CONCURRENT_WAIT_FOREVER) {
+		s->cv.wait(lock, available);
+	} else if (!s->cv.wait_for(lock, std::chrono::milliseconds(timeout), available)) {
+		return 1;
+	}
+	s->count--;
+	return 0;
+}
+
+int os_semaphore_give(os_semaphore_t sem, bool reserved)
+{
+	auto s = static_cast<semaphore*>(sem);
+	std::lock_guard<std::mutex> lock(s->mutex);
+	if (s->count >= s->max) {
+		return 1;
+	}
+	s->count++;
+	s->cv.notify_one();
+	return 0;
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
+
+typedef uint32_t system_tick_t;
+
 typedef void*os_queue_t;
 /**
  * Type by which queues are referenced.  For example, a call to xQueueCreate()
@@ -15,3 +20,13 @@ typedef std::function<os_thread_return_t(void)> wiring_thread_fn_t;
 typedef uint8_t os_thread_prio_t;
 
 os_result_t os_thread_exit(os_thread_t thread);
+os_result_t os_thread_yield(void);
+
+typedef void* os_semaphore_t;
+
+#define CONCURRENT_WAIT_FOREVER ((system_tick_t)-1)
+
+int os_semaphore_create(os_semaphore_t* semaphore, unsigned max, unsigned initial);
+int os_semaphore_destroy(os_semaphore_t semaphore);
+int os_semaphore_take(os_semaphore_t semaphore, system_tick_t timeout, bool reserved);
+int os_semaphore_give(os_semaphore_t semaphore, bool reserved);
@@ -1,5 +1,8 @@
 #include "BackgroundPublish.h"
+#include <atomic>
+#include <map>
 #include <thread>
+#include <vector>
 
 #define CATCH_CONFIG_MAIN
 #include "catch.h"
@@ -41,33 +44,26 @@ void priority_low_cb2(particle::Error status,
 
 class TestBackgroundPublish : public BackgroundPublish<> {
 public:
-    void processOnce();
-};
+    TestBackgroundPublish(std::size_t max_entries = 8,
+                          std::size_t max_payloads = 0,
+                          std::size_t max_isr_entries = 0,
+                          std::size_t max_trace_records = 0) :
+        BackgroundPublish<>(max_entries, max_payloads, max_isr_entries, max_trace_records)
+    {
+        // No publisher thread, so tests step the publisher with process()
+        setRunMode(run_mode::COOPERATIVE);
+    }
 
-void TestBackgroundPublish::processOnce()
-{
-    constexpr std::size_t burst_rate {2u}; // allowable burst rate (Hz), Device OS allows up to 4/s
-    constexpr system_tick_t process_interval {1000u};
-
-    // Publish time of the last (burst_rate) sends in a circular buffer
-    static system_tick_t publish_t[burst_rate] {};
-    static std::size_t i {}; // publish time of the previous (burst_rate)th send
-
-    auto now {millis()};
-    if(now - publish_t[i] >= process_interval) {
-        for(auto &queue : _queues) {
-            if(!queue.empty()) {
-                publish_t[i] = now;
-                i = (i + 1) % burst_rate;
-                // Copy the event and pop so the publish is done without holding the mutex
-                publish_event_t event {queue.front()};
-                queue.pop();
-                process_publish(event);
-                break;
-            }
-        }
+    using BackgroundPublish<>::free_events;
+    using BackgroundPublish<>::free_payloads;
+
+    // Moves the tick past the rate limit before sending the next event
+    bool processNext()
+    {
+        System.inc(1000);
+        return process();
     }
-}
+};
 
 TEST_CASE("Test Background Publish") {
     TestBackgroundPublish publisher;
@@ -119,10 +115,10 @@ TEST_CASE("Test Background Publish") {
                         PRIVATE,
                         1,
                         priority_low_cb ) == true);
-    System.inc(1000); // increase the tick by one second to allow processOnce to process
+    System.inc(1000); // increase the tick by one second to allow process to send
     // burst process two messages at t = 1000
-    publisher.processOnce();
-    publisher.processOnce();
+    publisher.process();
+    publisher.process();
     REQUIRE(low_cb_counter == 2);
     REQUIRE(status_returned == particle::Error::NONE);
 
@@ -136,18 +132,18 @@ TEST_CASE("Test Background Publish") {
                         0, 
                         priority_high_cb ) == true);
     System.inc(500); // not enough delay to process
-    publisher.processOnce(); //run to clear off the queues
+    publisher.process(); //run to clear off the queues
     REQUIRE(high_cb_counter == 0);
     REQUIRE(low_cb_counter == 0);
 
-    System.inc(500); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce(); //run to clear off the queues
+    System.inc(500); //increase the tick by one second to allow process to send
+    publisher.process(); //run to clear off the queues
     REQUIRE(high_cb_counter == 1);
     REQUIRE(low_cb_counter == 0);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN;
 
-    // LIMIT_EXCEEDED, run processOnce and fail on is.Succeeded()
+    // LIMIT_EXCEEDED, run process and fail on is.Succeeded()
     high_cb_counter = 0;
     low_cb_counter = 0;
     status_returned = particle::Error::UNKNOWN;
@@ -157,14 +153,14 @@ TEST_CASE("Test Background Publish") {
                         PRIVATE,
                         0, 
                         priority_high_cb);
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(high_cb_counter == 1);
     REQUIRE(low_cb_counter == 0);
     REQUIRE(status_returned == particle::Error::LIMIT_EXCEEDED);
     status_returned = particle::Error::UNKNOWN;
 
-    //NONE, run processOnce and pass on is.Succeeded()
+    //NONE, run process and pass on is.Succeeded()
     high_cb_counter = 0;
     low_cb_counter = 0;
     Particle.state_output.isDoneReturn = true;
@@ -185,22 +181,22 @@ TEST_CASE("Test Background Publish") {
                         0, 
                         priority_high_cb);
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(high_cb_counter == 1);
     REQUIRE(low_cb_counter == 0);
     REQUIRE(status_returned.type() == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN; //clearout to something
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(high_cb_counter == 2);
     REQUIRE(low_cb_counter == 0);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN; //clearout to something
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(high_cb_counter == 3);
     REQUIRE(low_cb_counter == 0);
     REQUIRE(status_returned == particle::Error::NONE);
@@ -241,43 +237,1528 @@ TEST_CASE("Test Background Publish") {
                         0, 
                         priority_high_cb);
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(low_cb_counter == 0);
     REQUIRE(high_cb_counter == 1);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN; //clear out to something
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(low_cb_counter == 0);
     REQUIRE(high_cb_counter == 2);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN; //clear out to something
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(low_cb_counter == 0);
     REQUIRE(high_cb_counter == 3);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN; //clear out to something
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(low_cb_counter == 1);
     REQUIRE(high_cb_counter == 3);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN; //clear out to something
 
-    System.inc(1000); //increase the tick by one second to allow processOnce to process
-    publisher.processOnce();
+    System.inc(1000); //increase the tick by one second to allow process to send
+    publisher.process();
     REQUIRE(low_cb_counter == 2);
     REQUIRE(high_cb_counter == 3);
     REQUIRE(status_returned == particle::Error::NONE);
     status_returned = particle::Error::UNKNOWN;
 
-    publisher.processOnce();
+    publisher.process();
     REQUIRE(status_returned == particle::Error::NONE);  // burst send
     REQUIRE(low_cb_counter == 3);
     REQUIRE(high_cb_counter == 3);
 }
+
+std::string data_returned;
+
+void capture_cb(particle::Error status,
+    const char *event_name,
+    const char *event_data) {
+    status_returned = status;
+    data_returned = event_data ? event_data : "";
+}
+
+int vpublishf_helper(TestBackgroundPublish& publisher,
+    TestBackgroundPublish::publish_callback cb,
+    const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    auto ret = publisher.vpublishf("TEST_PUB_FMT", PRIVATE, 0, cb, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+TEST_CASE("Test formatted publish") {
+    TestBackgroundPublish publisher;
+
+    // FAIL, publisher not started
+    REQUIRE(publisher.publishf("TEST_PUB_FMT", 0, "Counter:%d", 1) == particle::Error::INVALID_STATE);
+
+    publisher.start();
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    // PASS, formatted in place
+    REQUIRE(publisher.publishf("TEST_PUB_FMT", 0, "Counter:%d", 42) == 10);
+    publisher.cleanup();
+
+    // PASS, formatted in place with a callback
+    REQUIRE(vpublishf_helper(publisher, capture_cb, "Counter:%d", 43) == 10);
+    publisher.cleanup();
+    REQUIRE(data_returned == "Counter:43");
+
+    // PASS, truncation reported through the return value
+    std::string big(particle::protocol::MAX_EVENT_DATA_LENGTH + 10, 'x');
+    REQUIRE(vpublishf_helper(publisher, capture_cb, "%s", big.c_str()) == (int)big.size());
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(status_returned == particle::Error::NONE);
+    REQUIRE(data_returned == big.substr(0, particle::protocol::MAX_EVENT_DATA_LENGTH));
+
+    // FAIL, queue full
+    for(int i = 0; i < 8; i++) {
+        REQUIRE(publisher.publishf("TEST_PUB_FMT", 1, "%d", i) == 1);
+    }
+    REQUIRE(publisher.publishf("TEST_PUB_FMT", 1, "%d", 8) == particle::Error::BUSY);
+    publisher.cleanup();
+}
+
+TEST_CASE("Test JSON publish") {
+    TestBackgroundPublish publisher;
+    publisher.start();
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    auto len = publisher.publishJson("TEST_PUB_JSON", [](JSONWriter& writer) {
+        writer.beginObject();
+        writer.name("counter").value(42);
+        writer.name("ok").value(true);
+        writer.endObject();
+    }, PRIVATE, 0, capture_cb);
+    REQUIRE(len == 24);
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(data_returned == "{\"counter\":42,\"ok\":true}");
+
+    // PASS, truncated data is still null terminated
+    std::string big(particle::protocol::MAX_EVENT_DATA_LENGTH, 'x');
+    len = publisher.publishJson("TEST_PUB_JSON", [&](JSONWriter& writer) {
+        writer.beginObject();
+        writer.name("big").value(big.c_str());
+        writer.endObject();
+    }, PRIVATE, 0, capture_cb);
+    REQUIRE(len == (int)big.size() + 10);
+    publisher.cleanup();
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+    REQUIRE(data_returned.size() == particle::protocol::MAX_EVENT_DATA_LENGTH);
+
+    // FAIL, invalid priority and the callback is told why
+    REQUIRE(publisher.publishJson("TEST_PUB_JSON", [](JSONWriter& writer) {}, PRIVATE, 2, capture_cb) == particle::Error::INVALID_ARGUMENT);
+    REQUIRE(status_returned == particle::Error::INVALID_ARGUMENT);
+}
+
+TEST_CASE("Test deferred publish") {
+    TestBackgroundPublish publisher(8, 1);
+    publisher.start();
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    // PASS, data rendered when the event is sent, not when it is queued
+    int value = 1;
+    int renders = 0;
+    REQUIRE(publisher.publishDeferred("TEST_PUB_DEFER", [&](char* data, std::size_t size) {
+        renders++;
+        return snprintf(data, size, "value:%d", value);
+    }, PRIVATE, 0, capture_cb) == true);
+    value = 2;
+    REQUIRE(renders == 0);
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(renders == 1);
+    REQUIRE(status_returned == particle::Error::NONE);
+    REQUIRE(data_returned == "value:2");
+
+    // PASS, deferred events don't use one of the shared data buffers
+    REQUIRE(publisher.publish("TEST_PUB", str.c_str(), PRIVATE, 0, capture_cb) == true);
+    REQUIRE(publisher.publish("TEST_PUB", str.c_str(), PRIVATE, 0, capture_cb) == false);
+    REQUIRE(status_returned == particle::Error::BUSY);
+    REQUIRE(publisher.publishDeferred("TEST_PUB_DEFER", [](char* data, std::size_t size) {
+        return -1;
+    }, PRIVATE, 0, capture_cb) == true);
+
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(data_returned == str);
+    // Buffer returned to the pool once sent
+    REQUIRE(publisher.publish("TEST_PUB", str.c_str(), PRIVATE, 1, capture_cb) == true);
+
+    // CANCELLED, producer declined to render
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+    REQUIRE(data_returned == "");
+
+    // FAIL, producer required
+    REQUIRE(publisher.publishDeferred("TEST_PUB_DEFER", nullptr, PRIVATE, 0, capture_cb) == false);
+    REQUIRE(status_returned == particle::Error::INVALID_ARGUMENT);
+    publisher.cleanup();
+}
+
+TEST_CASE("Test bulk publish") {
+    using request = TestBackgroundPublish::publish_request_t;
+    using mode = TestBackgroundPublish::bulk_mode;
+    TestBackgroundPublish publisher(2);
+
+    request requests[3] {
+        {"TEST_PUB_BULK", "0", PRIVATE, 0, priority_high_cb},
+        {"TEST_PUB_BULK", "1", PRIVATE, 1, priority_low_cb},
+        {"TEST_PUB_BULK", "2", PRIVATE, 2, priority_low_cb},
+    };
+
+    // FAIL, publisher not started
+    high_cb_counter = 0;
+    low_cb_counter = 0;
+    REQUIRE(publisher.publishBulk(requests) == 0);
+    REQUIRE(requests[0].result == particle::Error::INVALID_STATE);
+    REQUIRE(requests[2].result == particle::Error::INVALID_STATE);
+    REQUIRE(high_cb_counter == 1);
+    REQUIRE(low_cb_counter == 2);
+
+    publisher.start();
+
+    // FAIL, one bad request rejects the whole batch
+    high_cb_counter = 0;
+    low_cb_counter = 0;
+    REQUIRE(publisher.publishBulk(requests, mode::ALL_OR_NOTHING) == 0);
+    REQUIRE(requests[0].result == particle::Error::CANCELLED);
+    REQUIRE(requests[1].result == particle::Error::CANCELLED);
+    REQUIRE(requests[2].result == particle::Error::INVALID_ARGUMENT);
+    REQUIRE(high_cb_counter == 1);
+    REQUIRE(low_cb_counter == 2);
+
+    // PASS, best effort queues the requests that fit
+    high_cb_counter = 0;
+    low_cb_counter = 0;
+    REQUIRE(publisher.publishBulk(requests, mode::BEST_EFFORT) == 2);
+    REQUIRE(requests[0].result == particle::Error::NONE);
+    REQUIRE(requests[1].result == particle::Error::NONE);
+    REQUIRE(requests[2].result == particle::Error::INVALID_ARGUMENT);
+    REQUIRE(high_cb_counter == 0);
+    REQUIRE(low_cb_counter == 1);
+
+    // FAIL, the batch doesn't fit in the priority 1 queue
+    request more[2] {
+        {"TEST_PUB_BULK", "3", PRIVATE, 1, priority_low_cb},
+        {"TEST_PUB_BULK", "4", PRIVATE, 1, priority_low_cb},
+    };
+    REQUIRE(publisher.publishBulk(more, mode::ALL_OR_NOTHING) == 0);
+    REQUIRE(more[0].result == particle::Error::CANCELLED);
+    REQUIRE(more[1].result == particle::Error::BUSY);
+
+    // PASS, best effort takes the first one
+    REQUIRE(publisher.publishBulk(more, mode::BEST_EFFORT) == 1);
+    REQUIRE(more[0].result == particle::Error::NONE);
+    REQUIRE(more[1].result == particle::Error::BUSY);
+
+    high_cb_counter = 0;
+    low_cb_counter = 0;
+    publisher.cleanup();
+    REQUIRE(high_cb_counter == 1);
+    REQUIRE(low_cb_counter == 2);
+}
+
+TEST_CASE("Test blocking publish") {
+    using namespace std::chrono;
+    TestBackgroundPublish publisher(1);
+    publisher.start();
+
+    REQUIRE(publisher.publish("TEST_PUB_BLOCK", str.c_str(), PRIVATE, 0, capture_cb) == true);
+
+    // FAIL, nothing frees the queue before the timeout
+    REQUIRE(publisher.publish("TEST_PUB_BLOCK", str.c_str(), PRIVATE, 0, capture_cb, milliseconds(10)) == false);
+    REQUIRE(status_returned == particle::Error::TIMEOUT);
+
+    // PASS, woken up when another thread frees the queue
+    std::thread consumer([&publisher] {
+        std::this_thread::sleep_for(milliseconds(20));
+        publisher.cleanup();
+    });
+    REQUIRE(publisher.publish("TEST_PUB_BLOCK", str.c_str(), PRIVATE, 0, capture_cb, seconds(10)) == true);
+    consumer.join();
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+
+    // FAIL, errors other than a full queue don't wait
+    REQUIRE(publisher.publish("TEST_PUB_BLOCK", str.c_str(), PRIVATE, 2, capture_cb, seconds(10)) == false);
+    REQUIRE(status_returned == particle::Error::INVALID_ARGUMENT);
+    publisher.cleanup();
+}
+
+TEST_CASE("Test overflow policy") {
+    using policy = TestBackgroundPublish::overflow_policy;
+    std::vector<std::string> cancelled;
+    auto record = [&](particle::Error status, const char* event_name, const char* event_data) {
+        status_returned = status;
+        cancelled.push_back(event_data);
+    };
+
+    // Queues of two entries sharing three data buffers
+    TestBackgroundPublish publisher(2, 3);
+    publisher.start();
+
+    // FAIL, default policy rejects the newest request
+    REQUIRE(publisher.publish("TEST_PUB", "a", PRIVATE, 0, record) == true);
+    REQUIRE(publisher.publish("TEST_PUB", "b", PRIVATE, 0, record) == true);
+    REQUIRE(publisher.publish("TEST_PUB", "c", PRIVATE, 0, record) == false);
+    REQUIRE(cancelled == std::vector<std::string> {"c"});
+    REQUIRE(status_returned == particle::Error::BUSY);
+
+    // PASS, drop oldest evicts "a" to make room for "c"
+    cancelled.clear();
+    publisher.setOverflowPolicy(0, policy::DROP_OLDEST);
+    REQUIRE(publisher.publish("TEST_PUB", "c", PRIVATE, 0, record) == true);
+    REQUIRE(cancelled == std::vector<std::string> {"a"});
+    REQUIRE(status_returned == particle::Error::BUSY);
+
+    // PASS, out of data buffers and drop oldest evicts from the same queue
+    cancelled.clear();
+    publisher.setOverflowPolicy(1, policy::DROP_OLDEST);
+    REQUIRE(publisher.publish("TEST_PUB", "d", PRIVATE, 1, record) == true);
+    REQUIRE(publisher.publish("TEST_PUB", "e", PRIVATE, 1, record) == true);
+    REQUIRE(cancelled == std::vector<std::string> {"d"});
+
+    // FAIL, drop oldest never touches another queue, and evicting a
+    // deferred event doesn't free a data buffer
+    cancelled.clear();
+    TestBackgroundPublish shared(2, 2);
+    shared.start();
+    shared.setOverflowPolicy(1, policy::DROP_OLDEST);
+    REQUIRE(shared.publish("TEST_PUB", "a", PRIVATE, 0, record) == true);
+    REQUIRE(shared.publish("TEST_PUB", "b", PRIVATE, 0, record) == true);
+    REQUIRE(shared.publishDeferred("TEST_PUB", [](char* data, std::size_t size) { return 0; }, PRIVATE, 1, record) == true);
+    REQUIRE(shared.publish("TEST_PUB", "c", PRIVATE, 1, record) == false);
+    REQUIRE(cancelled == std::vector<std::string> {"c"});
+    shared.cleanup();
+
+    // PASS, drop lowest priority evicts from priority 1 for a priority 0 event
+    publisher.setOverflowPolicy(0, policy::DROP_LOWEST_PRIORITY);
+    publisher.cleanup();
+    cancelled.clear();
+    REQUIRE(publisher.publish("TEST_PUB", "a", PRIVATE, 1, record) == true);
+    REQUIRE(publisher.publish("TEST_PUB", "b", PRIVATE, 1, record) == true);
+    REQUIRE(publisher.publish("TEST_PUB", "c", PRIVATE, 0, record) == true);
+    REQUIRE(publisher.publish("TEST_PUB", "d", PRIVATE, 0, record) == true);
+    REQUIRE(cancelled == std::vector<std::string> {"a"});
+
+    // PASS, a full queue evicts its own oldest event
+    REQUIRE(publisher.publish("TEST_PUB", "e", PRIVATE, 0, record) == true);
+    REQUIRE(cancelled == std::vector<std::string> {"a", "c"});
+
+    cancelled.clear();
+    publisher.cleanup();
+    REQUIRE(cancelled == std::vector<std::string> {"d", "e", "b"});
+}
+
+TEST_CASE("Test publish handle") {
+    using status = TestBackgroundPublish::publish_status;
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    // FAIL, rejected requests give an invalid handle
+    auto rejected = publisher.publish("TEST_PUB", str.c_str(), PRIVATE, 0, capture_cb);
+    REQUIRE(!rejected);
+    REQUIRE(rejected.status() == status::UNKNOWN);
+    REQUIRE(rejected.cancel() == false);
+
+    publisher.start();
+    auto first = publisher.publish("TEST_PUB", "first", PRIVATE, 1, capture_cb);
+    auto second = publisher.publish("TEST_PUB", "second", PRIVATE, 1, capture_cb);
+    REQUIRE(first);
+    REQUIRE(first.status() == status::QUEUED);
+
+    // PASS, cancelled event is skipped without using a send
+    REQUIRE(first.cancel() == true);
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+    REQUIRE(data_returned == "first");
+    REQUIRE(first.status() == status::CANCELLED);
+    REQUIRE(first.cancel() == false);
+
+    // PASS, the cancelled entry no longer counts against the queue size
+    auto third = publisher.publish("TEST_PUB", "third", PRIVATE, 1, capture_cb);
+    REQUIRE(third);
+
+    // PASS, reprioritized event jumps ahead of the older one
+    REQUIRE(third.reprioritize(0) == true);
+    REQUIRE(third.reprioritize(2) == false);
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(data_returned == "third");
+    REQUIRE(third.status() == status::SENT);
+    REQUIRE(third.reprioritize(1) == false);
+    REQUIRE(second.status() == status::QUEUED);
+
+    System.inc(1000);
+    Particle.state_output.err = particle::Error::LIMIT_EXCEEDED;
+    publisher.process();
+    REQUIRE(data_returned == "second");
+    REQUIRE(second.status() == status::FAILED);
+    Particle.state_output.err = particle::Error::NONE;
+
+    // PASS, handles expire once their event is reused
+    for(int i = 0; i < 8; i++) {
+        REQUIRE(publisher.publish("TEST_PUB", "again", PRIVATE, i % 2, capture_cb));
+        publisher.cleanup();
+    }
+    REQUIRE(first.status() == status::UNKNOWN);
+    REQUIRE(second.status() == status::UNKNOWN);
+
+    // PASS, retracted events don't leave stale entries to fill the queues,
+    // even when the publisher doesn't run in between
+    for(int i = 0; i < 40; i++) {
+        auto retracted = publisher.publish("TEST_PUB", "retracted", PRIVATE, 1, capture_cb);
+        REQUIRE(retracted);
+        if (i % 2) {
+            REQUIRE(retracted.cancel() == true);
+        } else {
+            REQUIRE(retracted.reprioritize(0) == true);
+            REQUIRE(retracted.cancel() == true);
+        }
+    }
+    REQUIRE(publisher.stats(0).depth == 0);
+    REQUIRE(publisher.stats(1).depth == 0);
+    auto last = publisher.publish("TEST_PUB", "last", PRIVATE, 1, capture_cb);
+    REQUIRE(last);
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(data_returned == "last");
+}
+
+TEST_CASE("Test publish future") {
+    using future = TestBackgroundPublish::publish_future;
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    // FAIL, rejected requests are done straight away
+    auto rejected = publisher.publishAsync("TEST_PUB_ASYNC", str.c_str());
+    REQUIRE(!rejected.isValid());
+    REQUIRE(rejected.isDone());
+    REQUIRE(rejected.error() == particle::Error::INVALID_STATE);
+
+    publisher.start();
+
+    // PASS, polled and waited on from another thread
+    auto first = publisher.publishAsync("TEST_PUB_ASYNC", "first", PRIVATE, 0);
+    REQUIRE(first.isValid());
+    REQUIRE(!first.isDone());
+    REQUIRE(first.error() == particle::Error::UNKNOWN);
+    REQUIRE(first.wait(std::chrono::milliseconds(1)) == false);
+
+    bool waited = false;
+    std::thread waiter([&] {
+        waited = first.wait(std::chrono::seconds(10));
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    System.inc(1000);
+    publisher.process();
+    waiter.join();
+    REQUIRE(waited);
+    REQUIRE(first.isDone());
+    REQUIRE(first.isSucceeded());
+
+    // PASS, chained callback on a pending and a completed future
+    int done_count = 0;
+    auto chained = [&](particle::Error status, const char* event_name, const char* event_data) {
+        status_returned = status;
+        data_returned = event_data;
+        done_count++;
+    };
+    first.onDone(chained);
+    REQUIRE(done_count == 1);
+    REQUIRE(data_returned == "");
+
+    future group[2];
+    group[0] = publisher.publishAsync("TEST_PUB_ASYNC", "second", PRIVATE, 1);
+    group[1] = publisher.publishAsync("TEST_PUB_ASYNC", "third", PRIVATE, 1);
+    group[1].onDone(chained);
+    REQUIRE(TestBackgroundPublish::waitAll(group, 2, std::chrono::milliseconds(1)) == false);
+
+    System.inc(1000);
+    publisher.process();
+    publisher.process();
+    REQUIRE(done_count == 2);
+    REQUIRE(data_returned == "third");
+    REQUIRE(TestBackgroundPublish::waitAll(group, 2, std::chrono::milliseconds(1)) == true);
+
+    // PASS, the outcome stays with the future until it is released
+    for(int i = 0; i < 8; i++) {
+        REQUIRE(publisher.publish("TEST_PUB", "again", PRIVATE, i % 2, capture_cb));
+        publisher.cleanup();
+    }
+    REQUIRE(first.isSucceeded());
+    group[0] = publisher.publishAsync("TEST_PUB_ASYNC", "fourth", PRIVATE, 1);
+    publisher.cleanup();
+    REQUIRE(group[0].error() == particle::Error::CANCELLED);
+    first.reset();
+    REQUIRE(!first.isValid());
+}
+
+TEST_CASE("Test deferred callback dispatch") {
+    using dispatch = TestBackgroundPublish::dispatch_mode;
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.setDispatchMode(dispatch::MANUAL);
+    publisher.start();
+
+    // PASS, callbacks wait for dispatchCompletions()
+    high_cb_counter = 0;
+    REQUIRE(publisher.publish("TEST_PUB", "first", PRIVATE, 0, capture_cb));
+    auto second = publisher.publish("TEST_PUB", "second", PRIVATE, 0, capture_cb);
+    REQUIRE(publisher.publish("TEST_PUB", "third", PRIVATE, 1, priority_high_cb));
+    status_returned = particle::Error::UNKNOWN;
+    data_returned.clear();
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(second.cancel());
+    REQUIRE(status_returned == particle::Error::UNKNOWN);
+    REQUIRE(second.status() == TestBackgroundPublish::publish_status::CANCELLED);
+
+    REQUIRE(publisher.dispatchCompletions() == 2);
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+    REQUIRE(data_returned == "second"); // data is still valid at dispatch time
+    REQUIRE(publisher.dispatchCompletions() == 0);
+
+    // PASS, rejections still call back straight away
+    REQUIRE(!publisher.publish("TEST_PUB", "fourth", PRIVATE, 2, capture_cb));
+    REQUIRE(status_returned == particle::Error::INVALID_ARGUMENT);
+
+    // PASS, stop() dispatches what cleanup() cancelled
+    publisher.stop();
+    REQUIRE(high_cb_counter == 1);
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+
+    // PASS, the executor runs just below the publisher, but not below 0
+    TestBackgroundPublish executor(2);
+    executor.setDispatchMode(dispatch::EXECUTOR);
+    executor.start(OS_THREAD_PRIORITY_DEFAULT);
+    REQUIRE(thread_priority == OS_THREAD_PRIORITY_DEFAULT - 1);
+    executor.stop();
+    executor.start(0);
+    REQUIRE(thread_priority == 0);
+    executor.stop();
+
+    // PASS, an evicted event gives its data buffer up before its callback is
+    // dispatched, so one eviction makes room for the new request
+    std::vector<std::string> evicted;
+    auto record = [&](particle::Error status, const char* event_name, const char* event_data) {
+        status_returned = status;
+        evicted.push_back(event_data);
+    };
+    TestBackgroundPublish shared(4, 3);
+    shared.setDispatchMode(dispatch::MANUAL);
+    shared.setOverflowPolicy(0, TestBackgroundPublish::overflow_policy::DROP_LOWEST_PRIORITY);
+    shared.setOverflowPolicy(1, TestBackgroundPublish::overflow_policy::DROP_OLDEST);
+    shared.start();
+    for(int i = 0; i < 3; i++) {
+        REQUIRE(shared.publish("TEST_PUB", "low", PRIVATE, 1, record));
+    }
+    REQUIRE(shared.publish("TEST_PUB", "high", PRIVATE, 0, record));
+    REQUIRE(shared.stats(1).evicted == 1);
+    REQUIRE(shared.publish("TEST_PUB", "newest", PRIVATE, 1, record));
+    REQUIRE(shared.stats(1).evicted == 2);
+    REQUIRE(shared.dispatchCompletions() == 2);
+    REQUIRE(evicted == std::vector<std::string> {"", ""});
+    REQUIRE(status_returned == particle::Error::BUSY);
+    shared.stop();
+}
+
+TEST_CASE("Test cleanup concurrency") {
+    TestBackgroundPublish publisher(4);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, another thread can publish while cleanup() runs callbacks
+    std::atomic<bool> published {false};
+    bool published_during_cleanup = false;
+    int cancelled_count = 0;
+    std::thread producer;
+    auto slow_cb = [&](particle::Error status, const char* event_name, const char* event_data) {
+        if(!producer.joinable()) {
+            producer = std::thread([&]() {
+                published = (bool)publisher.publish("TEST_PUB", "concurrent", PRIVATE, 0, capture_cb);
+            });
+            for(int i = 0; i < 1000 && !published; i++) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            published_during_cleanup = published;
+        }
+        if(status == particle::Error::CANCELLED) {
+            cancelled_count++;
+        }
+    };
+    for(int i = 0; i < 4; i++) {
+        REQUIRE(publisher.publish("TEST_PUB", "queued", PRIVATE, i % 2, slow_cb));
+    }
+    publisher.cleanup();
+    producer.join();
+    REQUIRE(published_during_cleanup);
+    REQUIRE(cancelled_count == 4);
+
+    // PASS, the event published during cleanup() is kept and sent
+    status_returned = particle::Error::UNKNOWN;
+    data_returned.clear();
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(status_returned == particle::Error::NONE);
+    REQUIRE(data_returned == "concurrent");
+
+    // PASS, every accepted publish is cancelled exactly once under contention
+    std::atomic<int> accepted {0};
+    std::atomic<int> cancelled {0};
+    auto count_cb = [&](particle::Error status, const char* event_name, const char* event_data) {
+        if(status == particle::Error::CANCELLED) {
+            cancelled++;
+        }
+    };
+    std::atomic<bool> producing {true};
+    producer = std::thread([&]() {
+        while(producing) {
+            if(publisher.publish("TEST_PUB", "stress", PRIVATE, accepted % 2, count_cb)) {
+                accepted++;
+            }
+        }
+    });
+    for(int i = 0; i < 100000 && accepted < 200; i++) {
+        publisher.cleanup();
+        std::this_thread::yield();
+    }
+    producing = false;
+    producer.join();
+    publisher.cleanup();
+    REQUIRE(accepted >= 200);
+    REQUIRE(cancelled == accepted);
+}
+
+TEST_CASE("Test concurrent publish") {
+    constexpr int producer_count = 4;
+    constexpr int publish_count = 2000;
+    TestBackgroundPublish publisher(8, 0, 0, 16);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, producers on several threads race each other and the consumer
+    std::atomic<int> accepted {0};
+    std::atomic<int> sent {0};
+    std::atomic<int> rejected {0};
+    std::atomic<bool> out_of_order {false};
+    int last_sent[producer_count][2]; // only touched by the consumer thread
+    std::fill(&last_sent[0][0], &last_sent[0][0] + producer_count * 2, -1);
+    auto count_cb = [&](particle::Error status, const char* event_name, const char* event_data) {
+        if(status != particle::Error::NONE) {
+            rejected++;
+            return;
+        }
+        int producer, seq;
+        std::sscanf(event_data, "%d %d", &producer, &seq);
+        if(seq <= last_sent[producer][seq % 2]) {
+            out_of_order = true;
+        }
+        last_sent[producer][seq % 2] = seq;
+        sent++;
+    };
+
+    std::atomic<int> producing {producer_count};
+    std::thread consumer([&]() {
+        while(producing > 0 || publisher.processNext()) {
+            publisher.processNext();
+        }
+    });
+    // Each producer and priority publishes under its own name, so a record
+    // mixing two writes has a name that doesn't match its priority
+    char names[producer_count][2][16];
+    std::map<std::uint32_t, std::size_t> name_priority;
+    for(int p = 0; p < producer_count; p++) {
+        for(int q = 0; q < 2; q++) {
+            std::snprintf(names[p][q], sizeof(names[p][q]), "TEST_PUB_%d_%d", p, q);
+            std::uint32_t hash {2166136261u}; // FNV-1a, as in the trace
+            for(auto c = names[p][q]; *c != '\0'; c++) {
+                hash = (hash ^ (std::uint8_t)*c) * 16777619u;
+            }
+            name_priority[hash] = q;
+        }
+    }
+    // Reads the trace while completions overwrite it
+    std::atomic<bool> tracing {true};
+    std::atomic<bool> torn_trace {false};
+    std::atomic<int> traced {0};
+    std::thread tracer([&]() {
+        BackgroundPublish<>::trace_record records[16];
+        bool more;
+        do {
+            more = tracing; // one last read once everything is traced
+            auto count {publisher.trace(records, 16)};
+            traced += count;
+            for(std::size_t i = 0; i < count; i++) {
+                auto name {name_priority.find(records[i].nameHash)};
+                if(name == name_priority.end() ||
+                   name->second != records[i].priority ||
+                   records[i].sent < records[i].enqueued ||
+                   records[i].completed < records[i].sent ||
+                   records[i].result != particle::Error::NONE) {
+                    torn_trace = true;
+                }
+            }
+        } while(more);
+    });
+    std::vector<std::thread> producers;
+    for(int p = 0; p < producer_count; p++) {
+        producers.emplace_back([&, p]() {
+            char data[16];
+            for(int seq = 0; seq < publish_count; seq++) {
+                std::snprintf(data, sizeof(data), "%d %d", p, seq);
+                if(publisher.publish(names[p][seq % 2], data, PRIVATE, seq % 2, count_cb)) {
+                    accepted++;
+                }
+            }
+            producing--;
+        });
+    }
+    for(auto &producer : producers) {
+        producer.join();
+    }
+    consumer.join();
+    tracing = false;
+    tracer.join();
+
+    REQUIRE(!out_of_order);
+    REQUIRE(traced > 0);
+    REQUIRE(!torn_trace);
+    REQUIRE(accepted > 0);
+    REQUIRE(sent == accepted);
+    REQUIRE(rejected == producer_count * publish_count - accepted);
+    publisher.stop();
+    REQUIRE(publisher.free_events() == 8 * 2 + 1);
+    REQUIRE(publisher.free_payloads() == 8 * 2);
+}
+
+TEST_CASE("Test publish from ISR") {
+    TestBackgroundPublish publisher(2, 0, 2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    // FAIL, publisher not running
+    REQUIRE(!publisher.publishFromISR("TEST_PUB_ISR", "early"));
+
+    publisher.start();
+
+    // FAIL, the regular publish paths can't be used from an interrupt and
+    // neither call back nor log there
+    isr_context = true;
+    status_returned = particle::Error::UNKNOWN;
+    auto logged {log_count.load()};
+    REQUIRE(!publisher.publish("TEST_PUB", "thread only", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.publishf("TEST_PUB", 0, "%s", "thread only") == particle::Error::INVALID_STATE);
+    TestBackgroundPublish::publish_request_t requests[1] {{"TEST_PUB", "thread only", PRIVATE, 0, capture_cb}};
+    REQUIRE(publisher.publishBulk(requests, TestBackgroundPublish::bulk_mode::ALL_OR_NOTHING) == 0);
+    REQUIRE(requests[0].result == particle::Error::INVALID_STATE);
+    REQUIRE(status_returned == particle::Error::UNKNOWN);
+    REQUIRE(log_count == logged);
+
+    // PASS, staged in the interrupt and queued by the publisher thread
+    status_returned = particle::Error::UNKNOWN;
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "first", PRIVATE, 1, capture_cb));
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "second", PRIVATE, 0, capture_cb));
+
+    // FAIL, all reserved entries are in use
+    REQUIRE(!publisher.publishFromISR("TEST_PUB_ISR", "third", PRIVATE, 0, capture_cb));
+    isr_context = false;
+    REQUIRE(status_returned == particle::Error::UNKNOWN);
+
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(status_returned == particle::Error::NONE);
+    REQUIRE(data_returned == "second");
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(data_returned == "first");
+
+    // FAIL, rejected by the publisher thread and called back from there
+    isr_context = true;
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "bad priority", PRIVATE, 2, capture_cb));
+    isr_context = false;
+    System.inc(1000);
+    publisher.process();
+    REQUIRE(status_returned == particle::Error::INVALID_ARGUMENT);
+    REQUIRE(data_returned == "bad priority");
+
+    // PASS, staged requests are queued while a send is in flight, freeing
+    // their entries for the next interrupt
+    Particle.state_output.isDoneReturn = false;
+    REQUIRE(publisher.publish("TEST_PUB", "in flight", PRIVATE, 0, capture_cb));
+    System.inc(1000);
+    publisher.process();
+    isr_context = true;
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "during 1", PRIVATE, 1, capture_cb));
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "during 2", PRIVATE, 1, capture_cb));
+    isr_context = false;
+    publisher.process();
+    REQUIRE(publisher.stats(1).depth == 2);
+    isr_context = true;
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "during 3", PRIVATE, 0, capture_cb));
+    isr_context = false;
+    Particle.state_output.isDoneReturn = true;
+    publisher.process();
+    REQUIRE(data_returned == "in flight");
+    for (auto expected : {"during 3", "during 1", "during 2"}) {
+        System.inc(1000);
+        publisher.process();
+        REQUIRE(data_returned == expected);
+    }
+
+    // PASS, staged requests are cancelled by stop() and free their entries
+    isr_context = true;
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "staged", PRIVATE, 0, capture_cb));
+    isr_context = false;
+    publisher.stop();
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+    REQUIRE(data_returned == "staged");
+    publisher.start();
+    isr_context = true;
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "first"));
+    REQUIRE(publisher.publishFromISR("TEST_PUB_ISR", "second"));
+    isr_context = false;
+
+    publisher.stop();
+}
+
+TEST_CASE("Test publish ring position wrap") {
+    // PASS, the capacity is rounded up to a power of two
+    PublishRing<int> ring(17, SIZE_MAX - 40);
+    REQUIRE(ring.capacity() == 32);
+
+    // PASS, values stay in order while the positions wrap around zero
+    int next_in {0};
+    int next_out {0};
+    for(int round = 0; round < 8; round++) {
+        for(int i = 0; i < 17; i++) {
+            REQUIRE(ring.push(next_in++));
+        }
+        REQUIRE(ring.size() == 17);
+        int value;
+        while(ring.pop(value)) {
+            REQUIRE(value == next_out++);
+        }
+    }
+    REQUIRE(ring.pushed() < 1000); // wrapped
+    REQUIRE(next_out == next_in);
+
+    // FAIL, full at the rounded capacity
+    for(int i = 0; i < 32; i++) {
+        REQUIRE(ring.push(i));
+    }
+    REQUIRE(!ring.push(32));
+}
+
+TEST_CASE("Test concurrent publish and cancel returns the pools") {
+    constexpr int producer_count = 2;
+    constexpr int publish_count = 50000;
+    TestBackgroundPublish publisher(12);
+
+    publisher.start();
+
+    // PASS, events and buffers freed while other threads take them come back
+    std::vector<std::thread> producers;
+    for(int p = 0; p < producer_count; p++) {
+        producers.emplace_back([&]() {
+            for(int seq = 0; seq < publish_count; seq++) {
+                auto handle {publisher.publish("TEST_PUB", "cancelled", PRIVATE, 1)};
+                if(handle) {
+                    handle.cancel();
+                }
+            }
+        });
+    }
+    for(auto &producer : producers) {
+        producer.join();
+    }
+
+    REQUIRE(publisher.free_events() == 12 * 2 + 1);
+    REQUIRE(publisher.free_payloads() == 12 * 2);
+    REQUIRE(publisher.publish("TEST_PUB", "after", PRIVATE, 1));
+    publisher.stop();
+    REQUIRE(publisher.free_events() == 12 * 2 + 1);
+}
+
+TEST_CASE("Test concurrent eviction and reprioritize") {
+    constexpr int publish_count = 20000;
+    using publisher_t = BackgroundPublish<3>;
+    // One data buffer, so publishing keeps evicting across the queues
+    publisher_t publisher(2, 1);
+    publisher.setRunMode(publisher_t::run_mode::COOPERATIVE);
+    publisher.setOverflowPolicy(0, publisher_t::overflow_policy::DROP_LOWEST_PRIORITY);
+    publisher.setOverflowPolicy(1, publisher_t::overflow_policy::DROP_LOWEST_PRIORITY);
+    publisher.start();
+
+    // PASS, eviction and reprioritize() take the queue locks without deadlocking
+    std::thread evicting([&]() {
+        for(int seq = 0; seq < publish_count; seq++) {
+            publisher.publish("TEST_PUB", "evicting", PRIVATE, 1 - seq % 2);
+        }
+    });
+    std::thread moving([&]() {
+        for(int seq = 0; seq < publish_count; seq++) {
+            auto handle {publisher.publishDeferred("TEST_PUB", [](char* data, std::size_t size) { return 0; }, PRIVATE, 1)};
+            if(handle) {
+                handle.reprioritize(2);
+                handle.cancel();
+            }
+        }
+    });
+    evicting.join();
+    moving.join();
+
+    REQUIRE(publisher.publish("TEST_PUB", "after", PRIVATE, 0));
+    publisher.stop();
+}
+
+TEST_CASE("Test concurrent cancel and reprioritize") {
+    constexpr int producer_count = 3;
+    constexpr int publish_count = 1000;
+    TestBackgroundPublish publisher(4);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, handles are used while the consumer works on other queues
+    std::atomic<int> accepted {0};
+    std::atomic<int> cancels {0};
+    std::atomic<int> sent {0};
+    std::atomic<int> cancelled {0};
+    auto count_cb = [&](particle::Error status, const char* event_name, const char* event_data) {
+        if(status == particle::Error::NONE) {
+            sent++;
+        } else if(status == particle::Error::CANCELLED) {
+            cancelled++;
+        }
+    };
+
+    std::atomic<int> producing {producer_count};
+    std::thread consumer([&]() {
+        while(producing > 0 || publisher.processNext()) {
+            publisher.processNext();
+        }
+    });
+    std::vector<std::thread> producers;
+    for(int p = 0; p < producer_count; p++) {
+        producers.emplace_back([&]() {
+            for(int seq = 0; seq < publish_count; seq++) {
+                auto handle {publisher.publish("TEST_PUB", "handled", PRIVATE, seq % 2, count_cb)};
+                if(!handle) {
+                    continue;
+                }
+                accepted++;
+                if(seq % 3 == 0 && handle.cancel()) {
+                    cancels++;
+                } else if(seq % 3 == 1) {
+                    handle.reprioritize(1 - seq % 2);
+                }
+            }
+            producing--;
+        });
+    }
+    for(auto &producer : producers) {
+        producer.join();
+    }
+    consumer.join();
+
+    REQUIRE(accepted > 0);
+    REQUIRE(cancelled == cancels);
+    REQUIRE(sent + cancelled == accepted);
+    publisher.stop();
+    REQUIRE(publisher.free_events() == 4 * 2 + 1);
+    REQUIRE(publisher.free_payloads() == 4 * 2);
+}
+
+class TestWidePublish : public BackgroundPublish<32> {
+public:
+    TestWidePublish(std::size_t max_entries) :
+        BackgroundPublish<32>(max_entries)
+    {
+        setRunMode(run_mode::COOPERATIVE);
+    }
+
+    bool processNext()
+    {
+        System.inc(1000);
+        return process();
+    }
+};
+
+TEST_CASE("Test wide priority range") {
+    TestWidePublish publisher(2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, the highest occupied priority is sent first across all 32 queues
+    REQUIRE(publisher.publish("TEST_PUB", "31", PRIVATE, 31, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "17", PRIVATE, 17, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "5", PRIVATE, 5, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "17 again", PRIVATE, 17, capture_cb));
+
+    REQUIRE(publisher.processNext());
+    REQUIRE(data_returned == "5");
+    REQUIRE(publisher.processNext());
+    REQUIRE(data_returned == "17");
+    REQUIRE(publisher.processNext());
+    REQUIRE(data_returned == "17 again");
+
+    // PASS, a cancelled event leaves a stale bit that is skipped
+    auto handle {publisher.publish("TEST_PUB", "0", PRIVATE, 0, capture_cb)};
+    REQUIRE(handle.cancel());
+    REQUIRE(!publisher.processNext());
+    REQUIRE(data_returned == "31");
+
+    // FAIL, priority out of range
+    REQUIRE(!publisher.publish("TEST_PUB", "32", PRIVATE, 32, capture_cb));
+    REQUIRE(status_returned == particle::Error::INVALID_ARGUMENT);
+
+    publisher.stop();
+}
+
+TEST_CASE("Test prompt stop") {
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = false;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, stop() abandons a publish still waiting for the cloud
+    status_returned = particle::Error::UNKNOWN;
+    REQUIRE(publisher.publish("TEST_PUB", "in flight", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "queued", PRIVATE, 1, priority_low_cb));
+    low_cb_counter = 0;
+    REQUIRE(publisher.processNext()); // returns while the cloud has not answered
+    REQUIRE(publisher.processNext());
+    REQUIRE(status_returned == particle::Error::UNKNOWN);
+    publisher.stop();
+    REQUIRE(status_returned == particle::Error::CANCELLED);
+    REQUIRE(data_returned == "in flight");
+    REQUIRE(low_cb_counter == 1); // cleanup() cancelled the rest
+
+    // FAIL, stopping twice
+    publisher.stop();
+    Particle.state_output.isDoneReturn = true;
+}
+
+TEST_CASE("Test cooperative process") {
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = false;
+    Particle.state_output.err = particle::Error::NONE;
+
+    // FAIL, nothing is sent before start()
+    REQUIRE(!publisher.process());
+
+    publisher.start();
+
+    // PASS, the send completes on a later call once the cloud answers
+    status_returned = particle::Error::UNKNOWN;
+    REQUIRE(publisher.publish("TEST_PUB", "first", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "second", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.processNext());
+    REQUIRE(status_returned == particle::Error::UNKNOWN);
+    Particle.state_output.isDoneReturn = true;
+    REQUIRE(publisher.process());
+    REQUIRE(status_returned == particle::Error::NONE);
+    REQUIRE(data_returned == "first");
+
+    // PASS, the rate limit holds back the third send within a second
+    REQUIRE(!publisher.process());
+    REQUIRE(data_returned == "second");
+    data_returned.clear();
+    REQUIRE(publisher.publish("TEST_PUB", "third", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.process());
+    REQUIRE(data_returned.empty());
+    REQUIRE(!publisher.processNext());
+    REQUIRE(data_returned == "third");
+
+    publisher.stop();
+}
+
+TEST_CASE("Test publish stats") {
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, accepted and rejected requests are counted per priority
+    REQUIRE(publisher.publish("TEST_PUB", "1", PRIVATE, 1, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "2", PRIVATE, 1, capture_cb));
+    REQUIRE(!publisher.publish("TEST_PUB", "3", PRIVATE, 1, capture_cb));
+    auto handle {publisher.publish("TEST_PUB", "4", PRIVATE, 0, capture_cb)};
+    REQUIRE(handle.cancel());
+    auto stats {publisher.stats(1)};
+    REQUIRE(stats.depth == 2);
+    REQUIRE(stats.highWater == 2);
+    REQUIRE(stats.enqueued == 2);
+    REQUIRE(stats.rejected == 1);
+    REQUIRE(publisher.stats(0).cancelled == 1);
+
+    // PASS, a blocking request that waited in vain counts as rejected too
+    REQUIRE(!publisher.publish("TEST_PUB", "3", PRIVATE, 1, capture_cb, std::chrono::milliseconds(5)));
+    REQUIRE(status_returned == particle::Error::TIMEOUT);
+    stats = publisher.stats(1);
+    REQUIRE(stats.rejected == 2);
+    REQUIRE(stats.timedOut == 0);
+
+    // PASS, send outcomes are counted by error
+    REQUIRE(publisher.processNext());
+    Particle.state_output.err = particle::Error::LIMIT_EXCEEDED;
+    REQUIRE(!publisher.processNext());
+    Particle.state_output.err = particle::Error::NONE;
+    stats = publisher.stats(1, true);
+    REQUIRE(stats.depth == 0);
+    REQUIRE(stats.sent == 1);
+    REQUIRE(stats.limited == 1);
+    REQUIRE(stats.failed == 0);
+
+    // PASS, reset zeroes the counters
+    stats = publisher.stats(1);
+    REQUIRE(stats.highWater == 0);
+    REQUIRE(stats.enqueued == 0);
+    REQUIRE(stats.sent == 0);
+
+    // PASS, evicted events are counted apart from rejected requests
+    publisher.setOverflowPolicy(1, BackgroundPublish<>::overflow_policy::DROP_OLDEST);
+    REQUIRE(publisher.publish("TEST_PUB", "5", PRIVATE, 1, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "6", PRIVATE, 1, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "7", PRIVATE, 1, capture_cb));
+    stats = publisher.stats(1);
+    REQUIRE(stats.evicted == 1);
+    REQUIRE(stats.rejected == 0);
+
+    // FAIL, a batch that can't be reserved was never enqueued or cancelled
+    TestBackgroundPublish::publish_request_t batch[2] {
+        {"TEST_PUB", "8", PRIVATE, 0, capture_cb},
+        {"TEST_PUB", "9", PRIVATE, 2, capture_cb},
+    };
+    REQUIRE(publisher.publishBulk(batch, TestBackgroundPublish::bulk_mode::ALL_OR_NOTHING) == 0);
+    stats = publisher.stats(0);
+    REQUIRE(stats.enqueued == 1);
+    REQUIRE(stats.cancelled == 1);
+
+    // FAIL, priority out of range
+    REQUIRE(publisher.stats(2).enqueued == 0);
+
+    publisher.stop();
+    REQUIRE(publisher.stats(1).cancelled == 2);
+}
+
+TEST_CASE("Test latency histograms") {
+    TestBackgroundPublish publisher(4);
+    Particle.state_output.isDoneReturn = false;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, queue wait and network time land in log-scale buckets
+    REQUIRE(publisher.publish("TEST_PUB", "1", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.processNext()); // queued for 1000 ms
+    System.inc(3);
+    Particle.state_output.isDoneReturn = true;
+    REQUIRE(!publisher.process()); // answered after 3 ms
+    auto stats {publisher.stats(0)};
+    REQUIRE(stats.queueWait.counts[10] == 1); // 512 - 1023 ms
+    REQUIRE(stats.network.counts[2] == 1); // 2 - 3 ms
+    REQUIRE(stats.queueWait.percentile(50) == 1024);
+    REQUIRE(stats.network.percentile(99) == 4);
+
+    // PASS, percentiles split the recorded latencies
+    for(int i = 0; i < 3; i++) {
+        REQUIRE(publisher.publish("TEST_PUB", "2", PRIVATE, 0, capture_cb));
+    }
+    while(publisher.processNext());
+    stats = publisher.stats(0, true);
+    REQUIRE(stats.network.counts[0] == 3);
+    REQUIRE(stats.network.percentile(50) == 1);
+    REQUIRE(stats.network.percentile(99) == 4);
+
+    // PASS, reset empties the histograms
+    stats = publisher.stats(0);
+    REQUIRE(stats.queueWait.percentile(50) == 0);
+    REQUIRE(stats.network.percentile(99) == 0);
+
+    publisher.stop();
+}
+
+struct counting_hooks : no_publish_hooks {
+    static int enqueued, dequeued, completed;
+    static std::size_t bytes;
+    static particle::Error last_error;
+
+    static void onEnqueue(const char* name, std::size_t priority) { enqueued++; }
+    static void onDequeue(const char* name, std::size_t priority) { dequeued++; }
+    static void onSend(const char* name, const char* data, std::size_t priority) { bytes += std::strlen(data); }
+    static void onComplete(const char* name, std::size_t priority, particle::Error error) {
+        completed++;
+        last_error = error;
+    }
+};
+int counting_hooks::enqueued {};
+int counting_hooks::dequeued {};
+int counting_hooks::completed {};
+std::size_t counting_hooks::bytes {};
+particle::Error counting_hooks::last_error;
+
+class TestHookedPublish : public BackgroundPublish<2, counting_hooks> {
+public:
+    TestHookedPublish() : BackgroundPublish<2, counting_hooks>(2)
+    {
+        setRunMode(run_mode::COOPERATIVE);
+    }
+};
+
+TEST_CASE("Test lifecycle hooks") {
+    TestHookedPublish publisher;
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, each stage of a sent event calls its hook
+    REQUIRE(publisher.publish("TEST_PUB", "four", PRIVATE, 0, capture_cb));
+    REQUIRE(counting_hooks::enqueued == 1);
+    System.inc(1000);
+    REQUIRE(!publisher.process());
+    REQUIRE(counting_hooks::dequeued == 1);
+    REQUIRE(counting_hooks::bytes == 4);
+    REQUIRE(counting_hooks::completed == 1);
+    REQUIRE(counting_hooks::last_error == particle::Error::NONE);
+
+    // PASS, a cancelled event completes without being sent
+    auto handle {publisher.publish("TEST_PUB", "five!", PRIVATE, 1, capture_cb)};
+    REQUIRE(handle.cancel());
+    REQUIRE(counting_hooks::enqueued == 2);
+    REQUIRE(counting_hooks::dequeued == 1);
+    REQUIRE(counting_hooks::completed == 2);
+    REQUIRE(counting_hooks::last_error == particle::Error::CANCELLED);
+
+    // FAIL, a rejected request is never queued
+    REQUIRE(!publisher.publish("TEST_PUB", "six", PRIVATE, 2, capture_cb));
+    REQUIRE(counting_hooks::enqueued == 2);
+
+    publisher.stop();
+}
+
+TEST_CASE("Test trace ring") {
+    TestBackgroundPublish publisher(4, 0, 0, 3);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+    BackgroundPublish<>::trace_record records[4];
+
+    publisher.start();
+
+    // PASS, nothing traced yet
+    REQUIRE(publisher.trace(records, 4) == 0);
+
+    // PASS, sent and cancelled events are recorded with their timestamps
+    REQUIRE(publisher.publish("TEST_A", "1", PRIVATE, 1, capture_cb));
+    auto queued {millis()};
+    REQUIRE(!publisher.processNext());
+    auto handle {publisher.publish("TEST_B", "2", PRIVATE, 0, capture_cb)};
+    REQUIRE(handle.cancel());
+    REQUIRE(publisher.trace(records, 4) == 2);
+    REQUIRE(records[0].priority == 1);
+    REQUIRE(records[0].enqueued == queued);
+    REQUIRE(records[0].sent == queued + 1000);
+    REQUIRE(records[0].completed == queued + 1000);
+    REQUIRE(records[0].result == particle::Error::NONE);
+    REQUIRE(records[1].nameHash != records[0].nameHash);
+    REQUIRE(records[1].sent == 0);
+    REQUIRE(records[1].result == particle::Error::CANCELLED);
+
+    // PASS, the ring keeps the most recent records, oldest first
+    for(int i = 0; i < 3; i++) {
+        REQUIRE(publisher.publish("TEST_A", "3", PRIVATE, 1, capture_cb));
+    }
+    while(publisher.processNext());
+    REQUIRE(publisher.trace(records, 4) == 3);
+    REQUIRE(records[0].result == particle::Error::NONE);
+    REQUIRE(records[0].nameHash == records[2].nameHash);
+    REQUIRE(records[0].completed < records[2].completed);
+
+    // PASS, fewer records than asked for
+    REQUIRE(publisher.trace(records, 1) == 1);
+    REQUIRE(records[0].completed == millis());
+    publisher.dumpTrace();
+
+    publisher.stop();
+}
+
+struct capture_hooks : no_publish_hooks {
+    static std::string sent_name, sent_data;
+
+    static void onSend(const char* name, const char* data, std::size_t priority) {
+        sent_name = name;
+        sent_data = data;
+    }
+};
+std::string capture_hooks::sent_name;
+std::string capture_hooks::sent_data;
+
+class TestDiagnosticPublish : public BackgroundPublish<2, capture_hooks> {
+public:
+    TestDiagnosticPublish() : BackgroundPublish<2, capture_hooks>(2)
+    {
+        setRunMode(run_mode::COOPERATIVE);
+    }
+};
+
+TEST_CASE("Test diagnostic publish") {
+    TestDiagnosticPublish publisher;
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.setDiagnostics("diag", std::chrono::milliseconds(5000), 1);
+    publisher.start();
+
+    // PASS, nothing is due before the interval
+    System.inc(4999);
+    REQUIRE(!publisher.process());
+
+    // PASS, the summary goes through the queue with the counters of each priority
+    REQUIRE(publisher.publish("TEST_PUB", "1", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.publish("TEST_PUB", "2", PRIVATE, 0, capture_cb));
+    REQUIRE(!publisher.publish("TEST_PUB", "3", PRIVATE, 0, capture_cb));
+    REQUIRE(publisher.process());
+    REQUIRE(capture_hooks::sent_data == "1");
+    System.inc(1);
+    REQUIRE(publisher.process()); // due, queued behind the last regular event
+    REQUIRE(capture_hooks::sent_data == "2");
+    System.inc(1000);
+    REQUIRE(!publisher.process());
+    REQUIRE(capture_hooks::sent_name == "diag");
+    REQUIRE(capture_hooks::sent_data == "0,2,1,0,1,2,1,1;0,1,0,0,1024,1024,0,0");
+
+    // PASS, a late summary is queued once, not once per missed interval
+    System.inc(10000);
+    REQUIRE(!publisher.process());
+    REQUIRE(capture_hooks::sent_data == "0,2,1,0,1,2,1,1;0,1,0,0,1,1024,1,1");
+    REQUIRE(publisher.stats(1).sent == 2);
+
+    // FAIL, can't change while running
+    publisher.setDiagnostics("diag", std::chrono::milliseconds(0));
+    System.inc(5000);
+    REQUIRE(!publisher.process());
+    REQUIRE(publisher.stats(1).sent == 3);
+
+    publisher.stop();
+}
+
+TEST_CASE("Test rate limited logging") {
+    TestBackgroundPublish publisher(1);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, a flood of rejected requests logs only the first few
+    REQUIRE(publisher.publish("TEST_PUB", "1", PRIVATE, 0, capture_cb));
+    log_count = 0;
+    for(int i = 0; i < 100; i++) {
+        REQUIRE(!publisher.publish("TEST_PUB", "2", PRIVATE, 0, capture_cb));
+    }
+    REQUIRE(log_count == 3);
+
+    // PASS, each log site has its own limit
+    REQUIRE(!publisher.publish("TEST_PUB", "3", PRIVATE, 2, capture_cb));
+    REQUIRE(log_count == 4);
+
+    // PASS, the next window sums up what was suppressed, then logs again
+    System.inc(10000);
+    REQUIRE(!publisher.publish("TEST_PUB", "4", PRIVATE, 0, capture_cb));
+    REQUIRE(log_count == 6);
+
+    // PASS, a flood that stops is summed up by the publisher once its
+    // window is over, and an idle publisher wakes up for it
+    for(int i = 0; i < 100; i++) {
+        REQUIRE(!publisher.publish("TEST_PUB", "5", PRIVATE, 0, capture_cb));
+    }
+    REQUIRE(log_count == 8);
+    System.inc(4000);
+    REQUIRE(!publisher.process());
+    publisher.process(); // clears the occupancy bit of the sent event
+    REQUIRE(log_count == 8);
+    REQUIRE(publisher.step() == 6000);
+    System.inc(6000);
+    REQUIRE(publisher.step() == CONCURRENT_WAIT_FOREVER);
+    REQUIRE(log_count == 9);
+
+    publisher.stop();
+}
+
+TEST_CASE("Test worker stats") {
+    // PASS, the publisher thread gets the priority and stack size passed to start()
+    {
+        BackgroundPublish<> publisher;
+        publisher.start(OS_THREAD_PRIORITY_DEFAULT + 1, 4096);
+        auto stats {publisher.workerStats()};
+        REQUIRE(stats.stackSize == 4096);
+        REQUIRE(stats.busyTime == 0);
+        publisher.stop();
+    }
+
+    TestBackgroundPublish publisher(2);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+
+    publisher.start();
+
+    // PASS, time spent in process() counts as busy, there is no thread stack
+    REQUIRE(publisher.publishDeferred("TEST_PUB", [](char* data, std::size_t size) {
+        System.inc(5); // a slow producer
+        return std::snprintf(data, size, "slow");
+    }, PRIVATE, 0, capture_cb));
+    REQUIRE(!publisher.processNext());
+    auto stats {publisher.workerStats(true)};
+    REQUIRE(stats.busyTime == 5);
+    REQUIRE(stats.idleTime == 0);
+    REQUIRE(stats.stackSize == 0);
+    REQUIRE(publisher.workerStats().busyTime == 0);
+
+    publisher.stop();
+}
+
+static system_tick_t sim_now {};
+static system_tick_t sim_clock() { return sim_now; }
+
+TEST_CASE("Test simulated clock") {
+    TestBackgroundPublish publisher(8);
+    Particle.state_output.isDoneReturn = true;
+    Particle.state_output.err = particle::Error::NONE;
+    sim_now = 0;
+    publisher.setClock(sim_clock);
+
+    // FAIL, step() only runs once started
+    REQUIRE(publisher.step() == CONCURRENT_WAIT_FOREVER);
+
+    publisher.start();
+
+    // PASS, two days of bursts driven by step() and the simulated clock
+    std::vector<system_tick_t> sent_at;
+    auto record_cb = [&](particle::Error status, const char *event_name, const char *event_data) {
+        if(status == particle::Error::NONE) {
+            sent_at.push_back(sim_now);
+        }
+    };
+    constexpr system_tick_t day {24u * 60u * 60u * 1000u};
+    constexpr system_tick_t burst_interval {60u * 1000u};
+    int accepted {};
+    for(system_tick_t burst = 0; burst < 2 * day; burst += burst_interval) {
+        sim_now = burst;
+        for(int i = 0; i < 5; i++) {
+            if(publisher.publish("TEST_PUB", "sim", PRIVATE, i % 2, record_cb)) {
+                accepted++;
+            }
+        }
+        for(auto wait = publisher.step(); wait != CONCURRENT_WAIT_FOREVER; wait = publisher.step()) {
+            sim_now += wait;
+        }
+    }
+    REQUIRE(accepted == 5 * 2 * 24 * 60);
+    REQUIRE(sent_at.size() == (std::size_t)accepted);
+    // No more than two sends in any second
+    bool over_rate {false};
+    for(std::size_t i = 2; i < sent_at.size(); i++) {
+        over_rate |= sent_at[i] - sent_at[i - 2] < 1000;
+    }
+    REQUIRE(!over_rate);
+    REQUIRE(publisher.stats(0).queueWait.percentile(99) == 1024);
+    REQUIRE(publisher.stats(1).queueWait.percentile(99) == 2048);
+
+    publisher.stop();
+}
+
+TEST_CASE("Test publisher thread with simulated cloud") {
+    CloudClass::Simulation cloud;
+    cloud.latency = std::chrono::milliseconds(20);
+    Particle.simulate(cloud);
+    System.realTime(true);
+
+    BackgroundPublish<> publisher(4);
+    publisher.start();
+
+    // PASS, the publisher thread sends and the cloud answers later
+    auto start {std::chrono::steady_clock::now()};
+    auto first {publisher.publishAsync("TEST_PUB", "1", PRIVATE, 0)};
+    auto second {publisher.publishAsync("TEST_PUB", "2", PRIVATE, 1)};
+    REQUIRE(first.wait(std::chrono::seconds(2)));
+    REQUIRE(second.wait(std::chrono::seconds(2)));
+    REQUIRE(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(20));
+    REQUIRE(first.isSucceeded());
+    REQUIRE(second.isSucceeded());
+    REQUIRE(Particle.acknowledged == 2);
+
+    // FAIL, a lost publish times out
+    cloud.loss = 1.0;
+    cloud.timeout = std::chrono::milliseconds(30);
+    Particle.simulate(cloud);
+    auto lost {publisher.publishAsync("TEST_PUB", "3", PRIVATE, 0)};
+    REQUIRE(lost.wait(std::chrono::seconds(2)));
+    REQUIRE(lost.error() == particle::Error::TIMEOUT);
+    REQUIRE(Particle.lost == 1);
+    publisher.stop();
+
+    // FAIL, the cloud's rate limit is tighter than the publisher's
+    cloud.loss = 0.0;
+    cloud.rateLimit = 1;
+    Particle.simulate(cloud);
+    publisher.start();
+    first = publisher.publishAsync("TEST_PUB", "4", PRIVATE, 0);
+    second = publisher.publishAsync("TEST_PUB", "5", PRIVATE, 0);
+    REQUIRE(first.wait(std::chrono::seconds(2)));
+    REQUIRE(second.wait(std::chrono::seconds(2)));
+    REQUIRE(first.isSucceeded());
+    REQUIRE(second.error() == particle::Error::LIMIT_EXCEEDED);
+    REQUIRE(publisher.stats(0).limited == 1);
+
+    // PASS, stop() cancels a publish the cloud hasn't answered yet
+    cloud.latency = std::chrono::seconds(10);
+    cloud.rateLimit = 0;
+    Particle.simulate(cloud);
+    auto slow {publisher.publishAsync("TEST_PUB", "6", PRIVATE, 0)};
+    while(Particle.acknowledged == 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    start = std::chrono::steady_clock::now();
+    publisher.stop();
+    REQUIRE(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+    REQUIRE(slow.error() == particle::Error::CANCELLED);
+
+    // PASS, the thread measured its stack
+    auto worker {publisher.workerStats()};
+    REQUIRE(worker.stackSize == OS_THREAD_STACK_SIZE_DEFAULT);
+    REQUIRE(worker.stackUsed > 0);
+    REQUIRE(worker.stackUsed < worker.stackSize);
+
+    System.realTime(false);
+    Particle.stopSimulation();
+}